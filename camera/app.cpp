@@ -15,6 +15,7 @@
 #include <chrono>
 #include <thread>
 
+#include "core/frame_trace.hpp"
 #include "core/libcamera_encoder.hpp"
 #include "network/output.hpp"
 #include "network/net_input.hpp"
@@ -50,16 +51,17 @@ static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
       key = '\n';
     else if (signal_received == SIGUSR2)
       key = 'x';
+    signal_received = 0;
   }
   return key;
 }
 
 static bool wait_for_options(VideoOptions *options, NetInput *netInput)
 {
-  size_t incoming_bytes = 0;
-  while(incoming_bytes == 0)
+  unsigned changes = 0;
+  while(changes == 0)
   {
-    incoming_bytes = netInput->poll_input();
+    changes = netInput->poll_input();
     std::this_thread::sleep_for(std::chrono::milliseconds(1000));
   }
   
@@ -70,10 +72,26 @@ static bool wait_for_options(VideoOptions *options, NetInput *netInput)
 static void execute_stream(LibcameraEncoder &app, VideoOptions *options, bool do_poll_options, NetInput *netInput)
 {
 
+  if (!options->trace_file.empty())
+    FrameTrace::Enable(options->trace_frames);
+
   std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
   app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+  app.SetFrameDroppedCallback(std::bind(&Output::FrameDropped, output.get(), _1));
+  if (output->TakesBuffers())
+  {
+    app.SetBufferReadyCallback(std::bind(&Output::BufferReady, output.get(), _1, _2, _3, _4, _5, _6, _7));
+    output->SetBufferDoneCallback(std::bind(&LibcameraEncoder::ReleaseBuffer, &app, _1));
+  }
+  else
+    app.SetBufferReadyCallback(nullptr);
   app.StartEncoder();
 
+  // Adaptive encode threads keep off this CPU, leaving it to the thread completing requests.
+  if (options->codec == "mjpeg" && options->encode_adaptive && options->encode_reserve_cpu >= 0 &&
+      options->encode_reserve_cpu < (int)std::thread::hardware_concurrency())
+    app.SetCompletionCpu(options->encode_reserve_cpu);
+
   app.OpenCamera();
   app.ConfigureVideo();
   app.StartCamera();
@@ -99,16 +117,42 @@ static void execute_stream(LibcameraEncoder &app, VideoOptions *options, bool do
       throw std::runtime_error("unrecognised message!");
     int key = get_key_or_signal(options, p);
     if (key == '\n')
-      output->Signal();
+    {
+      // With a circular buffer, ENTER or SIGUSR1 writes out the recent history instead of pausing.
+      if (options->circular)
+        output->Trigger();
+      else
+        output->Signal();
+    }
 
     if(do_poll_options && netInput != NULL)
     {
-      if(netInput->poll_input() > 0)
+      // Controls and encoder settings are changed live; only geometry, codec or output
+      // changes need the whole stream to be torn down and rebuilt.
+      unsigned changes = netInput->poll_input();
+      if(changes & CONFIG_RESTART)
       {
         std::cout << "New configuration received!" << std::endl;
+        netInput->controls().clear(); // the restart picks these up from the options
         end_early = true;
         continue;
       }
+      if(changes & CONFIG_CONTROLS)
+      {
+        std::cout << "New camera controls received" << std::endl;
+        app.SetControls(netInput->controls());
+        netInput->controls().clear();
+      }
+      if(changes & CONFIG_ENCODER)
+      {
+        std::cout << "New encoder settings received" << std::endl;
+        app.SetEncoderQuality(options->quality);
+      }
+      if(changes & CONFIG_TRIGGER)
+      {
+        std::cout << "Trigger received" << std::endl;
+        output->Trigger();
+      }
       //poll_options(options, &end_early);
     }
 
@@ -132,11 +176,16 @@ static void execute_stream(LibcameraEncoder &app, VideoOptions *options, bool do
     }
 
     CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+    bool motion = false;
+    if (completed_request->post_process_metadata.Get("motion_detect.result", motion) == 0 && motion)
+      output->Trigger();
     app.EncodeBuffer(completed_request, app.VideoStream());
   }
   
   app.StopCamera(); // stop complains if encoder very slow to close
   app.StopEncoder();
+  if (!options->trace_file.empty())
+    FrameTrace::Dump(options->trace_file);
   std::cout << "Stream destroyed" << std::endl;
 }
 
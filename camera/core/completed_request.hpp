@@ -7,27 +7,80 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <utility>
 
 #include <libcamera/controls.h>
 #include <libcamera/request.h>
 
 #include "core/metadata.hpp"
 
+// CompletedRequests are not allocated per frame. LibcameraApp keeps a pool with one per
+// libcamera Request, and refills them in place when the request completes; copying into
+// the existing buffer map and control list reuses their storage. When the last reference
+// is dropped the release function hands the slot, and its request, back to the camera.
 struct CompletedRequest
 {
 	using BufferMap = libcamera::Request::BufferMap;
 	using ControlList = libcamera::ControlList;
+	using ReleaseFunc = std::function<void(CompletedRequest *)>;
 
-	CompletedRequest(unsigned int seq, BufferMap const &b, ControlList const &m)
-		: sequence(seq), buffers(b), metadata(m)
+	CompletedRequest(ReleaseFunc release_func)
+		: sequence(0), timestamp(0), framerate(0), index(0), request(nullptr), generation(0), orphaned(false),
+		  refcount(0), release(std::move(release_func))
 	{
 	}
 	unsigned int sequence;
+	uint64_t timestamp; // sensor timestamp of the frame, in ns
 	BufferMap buffers;
 	ControlList metadata;
 	float framerate;
 	Metadata post_process_metadata;
+
+	// Pool bookkeeping, managed by LibcameraApp.
+	unsigned int index;
+	libcamera::Request *request; // null when frames come from a FrameSource
+	uint64_t generation;
+	bool orphaned;
+	std::atomic<unsigned int> refcount;
+	ReleaseFunc release;
 };
 
-using CompletedRequestPtr = std::shared_ptr<CompletedRequest>;
\ No newline at end of file
+// An intrusively reference counted handle to a pooled CompletedRequest, used just like
+// the std::shared_ptr it replaces.
+class CompletedRequestPtr
+{
+public:
+	CompletedRequestPtr() : ptr_(nullptr) {}
+	explicit CompletedRequestPtr(CompletedRequest *ptr) : ptr_(ptr)
+	{
+		if (ptr_)
+			ptr_->refcount.fetch_add(1, std::memory_order_relaxed);
+	}
+	CompletedRequestPtr(CompletedRequestPtr const &other) : CompletedRequestPtr(other.ptr_) {}
+	CompletedRequestPtr(CompletedRequestPtr &&other) noexcept : ptr_(std::exchange(other.ptr_, nullptr)) {}
+	~CompletedRequestPtr() { reset(); }
+
+	CompletedRequestPtr &operator=(CompletedRequestPtr other) noexcept
+	{
+		std::swap(ptr_, other.ptr_);
+		return *this;
+	}
+
+	void reset()
+	{
+		CompletedRequest *ptr = std::exchange(ptr_, nullptr);
+		if (ptr && ptr->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			ptr->release(ptr);
+	}
+
+	CompletedRequest *get() const { return ptr_; }
+	CompletedRequest *operator->() const { return ptr_; }
+	CompletedRequest &operator*() const { return *ptr_; }
+	explicit operator bool() const { return ptr_ != nullptr; }
+
+private:
+	CompletedRequest *ptr_;
+};
@@ -0,0 +1,396 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * frame_source.cpp - synthetic and file replay frames in place of a camera.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
+
+#include "core/frame_source.hpp"
+
+using libcamera::CameraConfiguration;
+using libcamera::FrameBuffer;
+using libcamera::Size;
+using libcamera::Span;
+using libcamera::StreamConfiguration;
+
+class FrameSource::SourceConfiguration : public CameraConfiguration
+{
+public:
+	Status validate() override;
+};
+
+CameraConfiguration::Status FrameSource::SourceConfiguration::validate()
+{
+	if (empty())
+		return Invalid;
+
+	Status status = Valid;
+	for (unsigned int i = 0; i < size(); i++)
+	{
+		StreamConfiguration &cfg = at(i);
+		if (cfg.pixelFormat != libcamera::formats::YUV420)
+		{
+			cfg.pixelFormat = libcamera::formats::YUV420;
+			status = Adjusted;
+		}
+
+		Size size = cfg.size;
+		size.alignDownTo(2, 2);
+		if (i > 0)
+		{
+			size.width = std::min(size.width, at(0).size.width);
+			size.height = std::min(size.height, at(0).size.height);
+			if (cfg.bufferCount != at(0).bufferCount)
+			{
+				cfg.bufferCount = at(0).bufferCount;
+				status = Adjusted;
+			}
+		}
+		if (size.width == 0 || size.height == 0 || cfg.bufferCount == 0)
+			return Invalid;
+		if (size != cfg.size)
+		{
+			cfg.size = size;
+			status = Adjusted;
+		}
+
+		// Match the row alignment the ISP gives us.
+		cfg.stride = (cfg.size.width + 63) & ~63;
+		cfg.frameSize = cfg.stride * cfg.size.height * 3 / 2;
+	}
+
+	return status;
+}
+
+class FrameSource::SourceStream : public libcamera::Stream
+{
+public:
+	SourceStream(StreamConfiguration const &config) { configuration_ = config; }
+	std::vector<std::unique_ptr<FrameBuffer>> buffers;
+};
+
+static void copyPlane(uint8_t *dst, unsigned int dst_stride, uint8_t const *src, unsigned int src_stride,
+					  unsigned int width, unsigned int height)
+{
+	for (unsigned int y = 0; y < height; y++, dst += dst_stride, src += src_stride)
+		memcpy(dst, src, width);
+}
+
+static void scalePlane(uint8_t *dst, unsigned int dst_stride, unsigned int dst_width, unsigned int dst_height,
+					   uint8_t const *src, unsigned int src_stride, unsigned int src_width, unsigned int src_height)
+{
+	for (unsigned int y = 0; y < dst_height; y++, dst += dst_stride)
+	{
+		uint8_t const *src_row = src + (y * src_height / dst_height) * src_stride;
+		for (unsigned int x = 0; x < dst_width; x++)
+			dst[x] = src_row[x * src_width / dst_width];
+	}
+}
+
+FrameSource::FrameSource(std::string const &source, bool verbose)
+	: source_(source), verbose_(verbose), frame_duration_us_(1000000 / 30)
+{
+	if (source_ == "pattern")
+		return;
+
+	int fd = open(source_.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("failed to open frame source file " + source_);
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		close(fd);
+		throw std::runtime_error("frame source file " + source_ + " is empty");
+	}
+	file_size_ = st.st_size;
+	void *mem = mmap(nullptr, file_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		throw std::runtime_error("failed to map frame source file " + source_);
+	file_mem_ = static_cast<uint8_t *>(mem);
+	madvise(file_mem_, file_size_, MADV_SEQUENTIAL);
+
+	if (verbose_)
+		std::cerr << "Replaying frames from " << source_ << std::endl;
+}
+
+FrameSource::~FrameSource()
+{
+	if (thread_.joinable())
+		Stop();
+	Teardown();
+	if (file_mem_)
+		munmap(file_mem_, file_size_);
+}
+
+std::unique_ptr<CameraConfiguration> FrameSource::GenerateConfiguration(libcamera::StreamRoles const &roles)
+{
+	std::unique_ptr<CameraConfiguration> config = std::make_unique<SourceConfiguration>();
+	for (libcamera::StreamRole role : roles)
+	{
+		if (role == libcamera::StreamRole::Raw)
+			throw std::runtime_error("raw streams need a camera");
+		StreamConfiguration cfg;
+		cfg.pixelFormat = libcamera::formats::YUV420;
+		cfg.size = role == libcamera::StreamRole::Viewfinder ? Size(800, 600) : Size(1920, 1080);
+		cfg.bufferCount = 4;
+		config->addConfiguration(cfg);
+	}
+	return config;
+}
+
+void FrameSource::Configure(CameraConfiguration *config)
+{
+	streams_.clear();
+	for (StreamConfiguration const &cfg : *config)
+		streams_.push_back(std::make_unique<SourceStream>(cfg));
+
+	Size const &size = streams_[0]->configuration().size;
+	if (file_mem_ && file_size_ < size.width * size.height * 3 / 2)
+		throw std::runtime_error("frame source file " + source_ + " holds less than one " + size.toString() +
+								 " frame");
+}
+
+libcamera::Stream *FrameSource::GetStream(unsigned int index) const
+{
+	return streams_.at(index).get();
+}
+
+void FrameSource::AllocateBuffers()
+{
+	if (streams_.empty())
+		throw std::runtime_error("frame source has no streams");
+
+	slots_.resize(streams_[0]->configuration().bufferCount);
+	for (auto &stream : streams_)
+	{
+		StreamConfiguration const &cfg = stream->configuration();
+		unsigned int y_size = cfg.stride * cfg.size.height;
+		unsigned int uv_size = y_size / 4;
+
+		for (Slot &slot : slots_)
+		{
+			int fd = memfd_create("frame_source", MFD_CLOEXEC);
+			if (fd < 0)
+				throw std::runtime_error("failed to create frame source buffer");
+			if (ftruncate(fd, cfg.frameSize) < 0)
+			{
+				close(fd);
+				throw std::runtime_error("failed to size frame source buffer");
+			}
+			void *mem = mmap(nullptr, cfg.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mem == MAP_FAILED)
+			{
+				close(fd);
+				throw std::runtime_error("failed to map frame source buffer");
+			}
+
+			// One fd for all three planes, which is how single plane buffers appear.
+			libcamera::SharedFD shared_fd(std::move(fd));
+			std::vector<FrameBuffer::Plane> planes(3);
+			unsigned int offsets[3] = { 0, y_size, y_size + uv_size };
+			unsigned int lengths[3] = { y_size, uv_size, uv_size };
+			for (unsigned int i = 0; i < 3; i++)
+			{
+				planes[i].fd = shared_fd;
+				planes[i].offset = offsets[i];
+				planes[i].length = lengths[i];
+			}
+
+			stream->buffers.push_back(std::make_unique<FrameBuffer>(planes));
+			slot.buffers[stream.get()] = stream->buffers.back().get();
+			slot.planes.push_back(Span<uint8_t>(static_cast<uint8_t *>(mem), cfg.frameSize));
+		}
+	}
+
+	if (verbose_)
+		std::cerr << "Frame source allocated " << slots_.size() << " buffers per stream" << std::endl;
+}
+
+std::vector<std::unique_ptr<FrameBuffer>> const &FrameSource::Buffers(libcamera::Stream *stream) const
+{
+	for (auto &s : streams_)
+	{
+		if (s.get() == stream)
+			return s->buffers;
+	}
+	throw std::runtime_error("unknown frame source stream");
+}
+
+void FrameSource::Teardown()
+{
+	for (Slot &slot : slots_)
+	{
+		for (auto &span : slot.planes)
+			munmap(span.data(), span.size());
+	}
+	slots_.clear();
+	streams_.clear();
+}
+
+void FrameSource::SetControls(libcamera::ControlList const &controls)
+{
+	if (controls.contains(libcamera::controls::FrameDurationLimits))
+		frame_duration_us_ = controls.get(libcamera::controls::FrameDurationLimits)[0];
+}
+
+void FrameSource::Start(FrameCallback callback)
+{
+	callback_ = callback;
+	abort_ = false;
+	frame_count_ = 0;
+	dropped_ = 0;
+	free_slots_ = {};
+	for (unsigned int i = 0; i < slots_.size(); i++)
+		free_slots_.push(i);
+	thread_ = std::thread(&FrameSource::sourceThread, this);
+}
+
+void FrameSource::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cv_.notify_all();
+	thread_.join();
+
+	if (verbose_)
+		std::cerr << "Frame source produced " << frame_count_ << " frames, dropped " << dropped_
+				  << " for want of a free buffer" << std::endl;
+}
+
+void FrameSource::Queue(unsigned int index)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	free_slots_.push(index);
+}
+
+void FrameSource::sourceThread()
+{
+	using namespace std::chrono;
+
+	auto next_frame = steady_clock::now();
+	while (true)
+	{
+		unsigned int index;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (cv_.wait_until(lock, next_frame, [this] { return abort_; }))
+				return;
+
+			// Don't try to catch up on frames we were too slow to make.
+			next_frame = std::max(next_frame + microseconds(frame_duration_us_.load()), steady_clock::now());
+
+			// Like a sensor, we lose the frame if nobody has given us a buffer for it.
+			if (free_slots_.empty())
+			{
+				dropped_++;
+				continue;
+			}
+			index = free_slots_.front();
+			free_slots_.pop();
+		}
+
+		Slot &slot = slots_[index];
+		StreamConfiguration const &main = streams_[0]->configuration();
+		if (file_mem_)
+			fillFromFile(slot.planes[0], main);
+		else
+			fillPattern(slot.planes[0], main);
+		for (unsigned int i = 1; i < streams_.size(); i++)
+			scaleDown(slot.planes[0], main, slot.planes[i], streams_[i]->configuration());
+		frame_count_++;
+
+		uint64_t timestamp_ns = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+		callback_(index, timestamp_ns);
+	}
+}
+
+void FrameSource::fillPattern(Span<uint8_t> buffer, StreamConfiguration const &config)
+{
+	// Colour bars (Y, U, V) that scroll sideways, crossed by an inverted band moving
+	// downwards, so that every frame differs from the last.
+	static const uint8_t bars[8][3] = { { 235, 128, 128 }, { 210, 16, 146 }, { 170, 166, 16 }, { 145, 54, 34 },
+										{ 106, 202, 222 }, { 81, 90, 240 }, { 41, 240, 110 }, { 16, 128, 128 } };
+	unsigned int w = config.size.width, h = config.size.height, stride = config.stride;
+
+	row_y_.resize(w);
+	row_inverted_.resize(w);
+	row_u_.resize(w / 2);
+	row_v_.resize(w / 2);
+	unsigned int offset = (frame_count_ * 4) % w;
+	for (unsigned int x = 0; x < w; x++)
+	{
+		uint8_t const *bar = bars[((x + offset) % w) * 8 / w];
+		row_y_[x] = bar[0];
+		row_inverted_[x] = 255 - bar[0];
+		if (!(x & 1))
+		{
+			row_u_[x / 2] = bar[1];
+			row_v_[x / 2] = bar[2];
+		}
+	}
+
+	uint8_t *Y = buffer.data();
+	uint8_t *U = Y + stride * h;
+	uint8_t *V = U + (stride / 2) * (h / 2);
+	unsigned int band_start = (frame_count_ * 2) % h;
+	for (unsigned int y = 0; y < h; y++)
+	{
+		bool in_band = (y + h - band_start) % h < h / 8;
+		memcpy(Y + y * stride, in_band ? row_inverted_.data() : row_y_.data(), w);
+	}
+	for (unsigned int y = 0; y < h / 2; y++)
+	{
+		memcpy(U + y * (stride / 2), row_u_.data(), w / 2);
+		memcpy(V + y * (stride / 2), row_v_.data(), w / 2);
+	}
+}
+
+void FrameSource::fillFromFile(Span<uint8_t> buffer, StreamConfiguration const &config)
+{
+	// The file holds tightly packed frames, which we play on a loop.
+	unsigned int w = config.size.width, h = config.size.height, stride = config.stride;
+	size_t frame_size = w * h * 3 / 2;
+	uint8_t const *src = file_mem_ + file_frame_ * frame_size;
+	file_frame_ = (file_frame_ + 1) % (file_size_ / frame_size);
+
+	uint8_t *Y = buffer.data();
+	uint8_t *U = Y + stride * h;
+	uint8_t *V = U + (stride / 2) * (h / 2);
+	copyPlane(Y, stride, src, w, w, h);
+	copyPlane(U, stride / 2, src + w * h, w / 2, w / 2, h / 2);
+	copyPlane(V, stride / 2, src + w * h * 5 / 4, w / 2, w / 2, h / 2);
+}
+
+void FrameSource::scaleDown(Span<uint8_t> const &src, StreamConfiguration const &src_config, Span<uint8_t> dst,
+							StreamConfiguration const &dst_config)
+{
+	unsigned int sw = src_config.size.width, sh = src_config.size.height, ss = src_config.stride;
+	unsigned int dw = dst_config.size.width, dh = dst_config.size.height, ds = dst_config.stride;
+
+	uint8_t const *src_y = src.data();
+	uint8_t const *src_u = src_y + ss * sh;
+	uint8_t const *src_v = src_u + (ss / 2) * (sh / 2);
+	uint8_t *dst_y = dst.data();
+	uint8_t *dst_u = dst_y + ds * dh;
+	uint8_t *dst_v = dst_u + (ds / 2) * (dh / 2);
+	scalePlane(dst_y, ds, dw, dh, src_y, ss, sw, sh);
+	scalePlane(dst_u, ds / 2, dw / 2, dh / 2, src_u, ss / 2, sw / 2, sh / 2);
+	scalePlane(dst_v, ds / 2, dw / 2, dh / 2, src_v, ss / 2, sw / 2, sh / 2);
+}
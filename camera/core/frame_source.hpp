@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * frame_source.hpp - synthetic and file replay frames in place of a camera.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/base/span.h>
+#include <libcamera/camera.h>
+#include <libcamera/controls.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/request.h>
+#include <libcamera/stream.h>
+
+// Produces YUV420 frames at a fixed rate without any camera, either as a moving test
+// pattern ("pattern") or by replaying a raw YUV420 file that has the same size as the
+// main stream, so that everything downstream of the camera can run on any machine.
+// It is configured like a libcamera Camera. Frames go round a fixed set of buffer slots,
+// as Requests do: a slot is filled and handed to the callback, and must be given back
+// with Queue().
+class FrameSource
+{
+public:
+	typedef std::function<void(unsigned int index, uint64_t timestamp_ns)> FrameCallback;
+
+	FrameSource(std::string const &source, bool verbose);
+	~FrameSource();
+
+	std::string const &Id() const { return source_; }
+
+	// Only YUV420 streams are available; the first is the main one, and any others are
+	// scaled down from it.
+	std::unique_ptr<libcamera::CameraConfiguration> GenerateConfiguration(libcamera::StreamRoles const &roles);
+	void Configure(libcamera::CameraConfiguration *config);
+	// The stream made for each StreamConfiguration, in order.
+	libcamera::Stream *GetStream(unsigned int index) const;
+	void AllocateBuffers();
+	std::vector<std::unique_ptr<libcamera::FrameBuffer>> const &Buffers(libcamera::Stream *stream) const;
+	unsigned int BufferCount() const { return slots_.size(); }
+	libcamera::Request::BufferMap const &SlotBuffers(unsigned int index) const { return slots_[index].buffers; }
+	// Release all the buffers and streams.
+	void Teardown();
+
+	// Only FrameDurationLimits means anything to us.
+	void SetControls(libcamera::ControlList const &controls);
+	int64_t FrameDuration() const { return frame_duration_us_; }
+
+	void Start(FrameCallback callback);
+	void Stop();
+	// Return a slot, once everyone has finished with its buffers, to be filled again.
+	void Queue(unsigned int index);
+
+private:
+	class SourceConfiguration;
+	class SourceStream;
+	struct Slot
+	{
+		libcamera::Request::BufferMap buffers;
+		std::vector<libcamera::Span<uint8_t>> planes; // one mapping per stream, as in streams_
+	};
+
+	void sourceThread();
+	void fillPattern(libcamera::Span<uint8_t> buffer, libcamera::StreamConfiguration const &config);
+	void fillFromFile(libcamera::Span<uint8_t> buffer, libcamera::StreamConfiguration const &config);
+	void scaleDown(libcamera::Span<uint8_t> const &src, libcamera::StreamConfiguration const &src_config,
+				   libcamera::Span<uint8_t> dst, libcamera::StreamConfiguration const &dst_config);
+
+	std::string source_;
+	bool verbose_;
+
+	std::vector<std::unique_ptr<SourceStream>> streams_;
+	std::vector<Slot> slots_;
+
+	// The file being replayed, if there is one.
+	uint8_t *file_mem_ = nullptr;
+	size_t file_size_ = 0;
+	size_t file_frame_ = 0;
+
+	// Scratch rows for drawing the test pattern.
+	std::vector<uint8_t> row_y_, row_inverted_, row_u_, row_v_;
+
+	std::atomic<int64_t> frame_duration_us_;
+	FrameCallback callback_;
+	uint64_t frame_count_ = 0;
+	uint64_t dropped_ = 0;
+	bool abort_ = false;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::queue<unsigned int> free_slots_;
+	std::thread thread_;
+};
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * frame_trace.cpp - per-frame latency timelines.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+
+#include "core/frame_trace.hpp"
+
+FrameTrace::Timeline *FrameTrace::ring_ = nullptr;
+unsigned int FrameTrace::size_ = 0;
+std::atomic<uint64_t> FrameTrace::next_(0);
+
+static int64_t now_ns()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void FrameTrace::Enable(unsigned int frames)
+{
+	// The ring lives as long as the process, as encoder and output threads may still be
+	// recording into it while everything shuts down.
+	if (ring_ || frames == 0)
+		return;
+	Timeline *ring = new Timeline[frames];
+	for (unsigned int i = 0; i < frames; i++)
+	{
+		ring[i].timestamp_us = -1;
+		for (auto &t : ring[i].times_ns)
+			t = 0;
+	}
+	size_ = frames;
+	ring_ = ring;
+}
+
+void FrameTrace::Begin(int64_t timestamp_us)
+{
+	if (!ring_)
+		return;
+	// Only the camera thread begins frames, so nobody else is after this slot, except for
+	// stragglers from a frame one whole ring ago. Hide it from them while it's cleared.
+	Timeline &t = ring_[next_ % size_];
+	t.timestamp_us.store(-1, std::memory_order_relaxed);
+	for (auto &time : t.times_ns)
+		time.store(0, std::memory_order_relaxed);
+	t.timestamp_us.store(timestamp_us, std::memory_order_release);
+	next_.fetch_add(1, std::memory_order_release);
+	Record(timestamp_us, REQUEST_COMPLETE);
+}
+
+FrameTrace::Timeline *FrameTrace::find(int64_t timestamp_us)
+{
+	// Frames are nearly always recorded soon after they begin, so search back from the newest.
+	uint64_t next = next_.load(std::memory_order_acquire);
+	for (uint64_t i = 1; i <= size_ && i <= next; i++)
+	{
+		Timeline &t = ring_[(next - i) % size_];
+		if (t.timestamp_us.load(std::memory_order_acquire) == timestamp_us)
+			return &t;
+	}
+	return nullptr;
+}
+
+void FrameTrace::Record(int64_t timestamp_us, Event event, unsigned int stage)
+{
+	if (!ring_ || stage >= MAX_STAGES)
+		return;
+	Timeline *t = find(timestamp_us);
+	if (!t)
+		return;
+
+	unsigned int index = event >= STAGE_START ? event + 2 * stage : static_cast<unsigned int>(event);
+	bool is_end = event == ENCODE_END || event == OUTPUT_END || event == STAGE_END;
+	int64_t now = now_ns();
+	if (is_end)
+		t->times_ns[index].store(now, std::memory_order_relaxed);
+	else
+	{
+		int64_t unset = 0;
+		t->times_ns[index].compare_exchange_strong(unset, now, std::memory_order_relaxed);
+	}
+}
+
+// Chrome trace async events, so that the spans of overlapping frames needn't nest.
+static void write_span(std::ofstream &out, bool &first, char const *name, int64_t id, int64_t start_ns, int64_t end_ns)
+{
+	if (!start_ns || !end_ns || end_ns < start_ns)
+		return;
+	for (int i = 0; i < 2; i++)
+	{
+		out << (first ? "\n" : ",\n") << "{\"name\":\"" << name << "\",\"cat\":\"frame\",\"ph\":\""
+			<< (i ? 'e' : 'b') << "\",\"id\":" << id << ",\"pid\":1,\"tid\":1,\"ts\":" << std::fixed
+			<< std::setprecision(3) << (i ? end_ns : start_ns) / 1000.0 << ",\"args\":{\"sensor_us\":" << id << "}}";
+		first = false;
+	}
+}
+
+void FrameTrace::Dump(std::string const &filename)
+{
+	if (!ring_)
+		return;
+	std::ofstream out(filename);
+	if (!out)
+		throw std::runtime_error("failed to open trace file " + filename);
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	uint64_t next = next_.load(std::memory_order_acquire);
+	for (uint64_t n = next > size_ ? next - size_ : 0; n < next; n++)
+	{
+		// Take a copy, and skip the frame if it was replaced while we were reading it.
+		Timeline &t = ring_[n % size_];
+		int64_t id = t.timestamp_us.load(std::memory_order_acquire);
+		int64_t times[NUM_EVENTS];
+		for (unsigned int i = 0; i < NUM_EVENTS; i++)
+			times[i] = t.times_ns[i].load(std::memory_order_relaxed);
+		if (id < 0 || t.timestamp_us.load(std::memory_order_acquire) != id)
+			continue;
+
+		// The sensor timestamp is only comparable when the camera uses the same clock.
+		int64_t sensor_ns = id * 1000, complete_ns = times[REQUEST_COMPLETE];
+		if (complete_ns > sensor_ns && complete_ns - sensor_ns < 1000000000)
+			write_span(out, first, "capture", id, sensor_ns, complete_ns);
+		for (unsigned int s = 0; s < MAX_STAGES; s++)
+		{
+			std::string name = "stage " + std::to_string(s);
+			write_span(out, first, name.c_str(), id, times[STAGE_START + 2 * s], times[STAGE_END + 2 * s]);
+		}
+		write_span(out, first, "encode queue", id, times[ENCODE_QUEUED], times[ENCODE_START]);
+		write_span(out, first, "encode", id, times[ENCODE_START], times[ENCODE_END]);
+		write_span(out, first, "output", id, times[OUTPUT_START], times[OUTPUT_END]);
+		write_span(out, first, "frame", id, complete_ns, times[OUTPUT_END]);
+	}
+	out << "\n]}\n";
+}
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * frame_trace.hpp - per-frame latency timelines.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Records when each frame passes each point of the pipeline, from the camera through the
+// post-processing stages and encoder to the output. Frames are identified by their sensor
+// timestamp in microseconds, which is the one thing every part of the pipeline knows.
+// Timelines go in a fixed ring of the most recent frames, written without locks, and can
+// be dumped as Chrome trace JSON (for chrome://tracing or Perfetto).
+//
+// Tracing is off until Enable() is called, and until then every call returns at once.
+class FrameTrace
+{
+public:
+	enum Event
+	{
+		REQUEST_COMPLETE,
+		ENCODE_QUEUED,
+		ENCODE_START,
+		ENCODE_END,
+		OUTPUT_START,
+		OUTPUT_END,
+		STAGE_START, // stage n starts at STAGE_START + 2n, and ends one later
+		STAGE_END
+	};
+	static constexpr unsigned int MAX_STAGES = 8;
+	static constexpr unsigned int NUM_EVENTS = STAGE_START + 2 * MAX_STAGES;
+
+	// Keep timelines for this many of the most recent frames.
+	static void Enable(unsigned int frames);
+	static bool Enabled() { return ring_ != nullptr; }
+
+	// Start the timeline for a new frame.
+	static void Begin(int64_t timestamp_us);
+	// Record an event against a frame, as now. Where an event happens more than once (as
+	// when a frame is encoded in parts) we keep the first start and the last end.
+	static void Record(int64_t timestamp_us, Event event, unsigned int stage = 0);
+
+	// Write out every frame in the ring.
+	static void Dump(std::string const &filename);
+
+private:
+	struct Timeline
+	{
+		std::atomic<int64_t> timestamp_us;
+		std::atomic<int64_t> times_ns[NUM_EVENTS]; // steady clock, 0 if not reached
+	};
+
+	static Timeline *find(int64_t timestamp_us);
+
+	static Timeline *ring_;
+	static unsigned int size_;
+	static std::atomic<uint64_t> next_;
+};
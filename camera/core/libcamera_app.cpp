@@ -5,7 +5,11 @@
  * libcamera_app.cpp - base class for libcamera apps.
  */
 
+#include <pthread.h>
+#include <sched.h>
+
 #include "core/frame_info.hpp"
+#include "core/frame_trace.hpp"
 #include "core/libcamera_app.hpp"
 #include "core/options.hpp"
 
@@ -30,7 +34,7 @@ LibcameraApp::~LibcameraApp()
 
 std::string const &LibcameraApp::CameraId() const
 {
-	return camera_->id();
+	return frame_source_ ? frame_source_->Id() : camera_->id();
 }
 
 void LibcameraApp::OpenCamera()
@@ -39,6 +43,26 @@ void LibcameraApp::OpenCamera()
 	if (options_->verbose)
 		std::cerr << "Opening camera..." << std::endl;
 
+	// Anything other than a camera stands in for one through a FrameSource.
+	if (options_->source != "camera")
+		frame_source_ = std::make_unique<FrameSource>(options_->source, options_->verbose);
+	else
+		acquireCamera();
+
+	if (!options_->post_process_file.empty())
+		post_processor_.Read(options_->post_process_file);
+	// The queue takes over ownership from the post-processor.
+	post_processor_.SetCallback([this](CompletedRequestPtr &r) {
+		// If the application has fallen this far behind, dropping the request returns its
+		// buffers to the camera straight away.
+		if (!this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))) &&
+			this->msg_queue_.Overflows() == this->reported_overflows_ + 1)
+			std::cerr << "WARNING: message queue full, dropping completed requests" << std::endl;
+	});
+}
+
+void LibcameraApp::acquireCamera()
+{
 	camera_manager_ = std::make_unique<CameraManager>();
 	int ret = camera_manager_->start();
 	if (ret)
@@ -58,16 +82,11 @@ void LibcameraApp::OpenCamera()
 
 	if (options_->verbose)
 		std::cerr << "Acquired camera " << cam_id << std::endl;
-
-	if (!options_->post_process_file.empty())
-		post_processor_.Read(options_->post_process_file);
-	// The queue takes over ownership from the post-processor.
-	post_processor_.SetCallback(
-		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
 }
 
 void LibcameraApp::CloseCamera()
 {
+	frame_source_.reset();
 
 	if (camera_acquired_)
 		camera_->release();
@@ -86,6 +105,9 @@ void LibcameraApp::ConfigureStill(unsigned int flags)
 	if (options_->verbose)
 		std::cerr << "Configuring still capture..." << std::endl;
 
+	if (frame_source_)
+		throw std::runtime_error("still capture needs a camera");
+
 	// Will add a raw capture stream once that works properly.
 	bool have_raw_stream = flags & FLAG_STILL_RAW;
 	StreamRoles stream_roles;
@@ -152,7 +174,10 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 	}
 	if (have_lores_stream)
 		stream_roles.push_back(StreamRole::Viewfinder);
-	configuration_ = camera_->generateConfiguration(stream_roles);
+	if (frame_source_)
+		configuration_ = frame_source_->GenerateConfiguration(stream_roles);
+	else
+		configuration_ = camera_->generateConfiguration(stream_roles);
 	if (!configuration_)
 		throw std::runtime_error("failed to generate video configuration");
 
@@ -192,11 +217,11 @@ void LibcameraApp::ConfigureVideo(unsigned int flags)
 	configureDenoise(options_->denoise == "auto" ? "cdn_fast" : options_->denoise);
 	setupCapture();
 
-	streams_["video"] = configuration_->at(0).stream();
+	streams_["video"] = configuredStream(0);
 	if (have_raw_stream)
-		streams_["raw"] = configuration_->at(1).stream();
+		streams_["raw"] = configuredStream(1);
 	if (have_lores_stream)
-		streams_["lores"] = configuration_->at(lores_index).stream();
+		streams_["lores"] = configuredStream(lores_index);
 
 	post_processor_.Configure();
 
@@ -211,11 +236,9 @@ void LibcameraApp::Teardown()
 	if (options_->verbose && !options_->help)
 		std::cerr << "Tearing down requests, buffers and configuration" << std::endl;
 
-	for (auto &iter : mapped_buffers_)
+	for (auto &mapped_buffer : mapped_buffers_)
 	{
-		// assert(iter.first->planes().size() == iter.second.size());
-		// for (unsigned i = 0; i < iter.first->planes().size(); i++)
-		for (auto &span : iter.second)
+		for (auto &span : mapped_buffer.planes)
 			munmap(span.data(), span.size());
 	}
 	mapped_buffers_.clear();
@@ -223,6 +246,9 @@ void LibcameraApp::Teardown()
 	delete allocator_;
 	allocator_ = nullptr;
 
+	if (frame_source_)
+		frame_source_->Teardown();
+
 	configuration_.reset();
 
 	frame_buffers_.clear();
@@ -233,11 +259,15 @@ void LibcameraApp::Teardown()
 void LibcameraApp::StartCamera()
 {
 	// This makes all the Request objects that we shall need.
-	makeRequests();
+	if (frame_source_)
+		makeCompletedRequests(frame_source_->BufferCount());
+	else
+		makeRequests();
 
 	// Build a list of initial controls that we must set in the camera before starting it.
 	// We don't overwrite anything the application may have set before calling us.
-	if (!controls_.contains(controls::ScalerCrop) && options_->roi_width != 0 && options_->roi_height != 0)
+	if (!controls_.contains(controls::ScalerCrop) && options_->roi_width != 0 && options_->roi_height != 0 &&
+		!frame_source_)
 	{
 		Rectangle sensor_area = camera_->properties().get(properties::ScalerCropMaximum);
 		int x = options_->roi_x * sensor_area.width;
@@ -290,6 +320,20 @@ void LibcameraApp::StartCamera()
 
 	post_processor_.Start();
 
+	if (frame_source_)
+	{
+		// Frames start arriving, and being released, as soon as the source starts.
+		frame_source_->SetControls(controls_);
+		controls_.clear();
+		camera_started_ = true;
+		last_timestamp_ = 0;
+		frame_source_->Start(std::bind(&LibcameraApp::sourceFrameComplete, this, std::placeholders::_1,
+									   std::placeholders::_2));
+		if (options_->verbose)
+			std::cerr << "Frame source started!" << std::endl;
+		return;
+	}
+
 	if (camera_->start(&controls_))
 		throw std::runtime_error("failed to start camera");
 	controls_.clear();
@@ -310,31 +354,42 @@ void LibcameraApp::StartCamera()
 
 void LibcameraApp::StopCamera()
 {
+	bool was_started = false;
 	{
 		// We don't want QueueRequest to run asynchronously while we stop the camera.
 		std::lock_guard<std::mutex> lock(camera_stop_mutex_);
 		if (camera_started_)
 		{
-			if (camera_->stop())
+			if (!frame_source_ && camera_->stop())
 				throw std::runtime_error("failed to stop camera");
 
-			post_processor_.Stop();
-
+			// An application might be holding a CompletedRequest, so queueRequest will get
+			// called to release it later, but we need to know not to try and re-queue it.
+			generation_++;
 			camera_started_ = false;
+			was_started = true;
 		}
 	}
 
+	// Stop the frame source and post-processor without the lock, as requests they drop
+	// get released (through queueRequest) from their threads.
+	if (was_started)
+	{
+		if (frame_source_)
+			frame_source_->Stop();
+		post_processor_.Stop();
+	}
+
 	if (camera_)
 		camera_->requestCompleted.disconnect(this, &LibcameraApp::requestComplete);
 
-	// An application might be holding a CompletedRequest, so queueRequest will get
- 	// called to delete it later, but we need to know not to try and re-queue it.
- 	known_completed_requests_.clear();
-
 	msg_queue_.Clear();
-
-	while (!free_requests_.empty())
-		free_requests_.pop();
+	if (msg_queue_.Overflows() != reported_overflows_)
+	{
+		std::cerr << "WARNING: " << msg_queue_.Overflows() - reported_overflows_
+				  << " completed requests dropped by a full message queue" << std::endl;
+		reported_overflows_ = msg_queue_.Overflows();
+	}
 
 	requests_.clear();
 
@@ -349,45 +404,42 @@ LibcameraApp::Msg LibcameraApp::Wait()
 	return msg_queue_.Wait();
 }
 
-void LibcameraApp::queueRequest(CompletedRequest *completed_request)
+size_t LibcameraApp::WaitMany(std::vector<Msg> &msgs, size_t max)
 {
-	BufferMap buffers(std::move(completed_request->buffers));
- 	delete completed_request;
+	return msg_queue_.WaitMany(msgs, max);
+}
 
+void LibcameraApp::queueRequest(CompletedRequest *completed_request)
+{
 	// This function may run asynchronously so needs protection from the
 	// camera stopping at the same time.
 	std::lock_guard<std::mutex> stop_lock(camera_stop_mutex_);
-	if (!camera_started_)
+
+	// A camera restart while this was still held took it out of the pool.
+	if (completed_request->orphaned)
+	{
+		delete completed_request;
 		return;
+	}
 
 	// An application could be holding a CompletedRequest while it stops and re-starts
- 	// the camera, after which we don't want to queue another request now.
- 	auto it = known_completed_requests_.find(completed_request);
- 	if (it == known_completed_requests_.end())
- 		return;
- 	known_completed_requests_.erase(it);
+	// the camera, after which we don't want to queue another request now.
+	if (!camera_started_ || completed_request->generation != generation_)
+		return;
 
-	Request *request = nullptr;
+	if (frame_source_)
 	{
-		std::lock_guard<std::mutex> lock(free_requests_mutex_);
-		if (!free_requests_.empty())
 		{
-			request = free_requests_.front();
-			free_requests_.pop();
+			std::lock_guard<std::mutex> lock(control_mutex_);
+			frame_source_->SetControls(controls_);
+			controls_.clear();
 		}
-	}
-	if (!request)
-	{
-		std::cerr << "WARNING: could not make request!" << std::endl;
+		frame_source_->Queue(completed_request->index);
 		return;
 	}
 
-	for (auto const &p : buffers)
-	{
-		if (request->addBuffer(p.first, p.second) < 0)
-			throw std::runtime_error("failed to add buffer to request in QueueRequest");
-	}
-
+	// The request kept its buffers when it was reused, so it only needs the latest controls.
+	Request *request = completed_request->request;
 	{
 		std::lock_guard<std::mutex> lock(control_mutex_);
 		request->controls() = std::move(controls_);
@@ -399,7 +451,8 @@ void LibcameraApp::queueRequest(CompletedRequest *completed_request)
 
 void LibcameraApp::PostMessage(MsgType &t, MsgPayload &p)
 {
-	msg_queue_.Post(Msg(t, std::move(p)));
+	if (!msg_queue_.Post(Msg(t, std::move(p))))
+		std::cerr << "WARNING: message queue full, message dropped" << std::endl;
 }
 
 libcamera::Stream *LibcameraApp::GetStream(std::string const &name, unsigned int *w, unsigned int *h,
@@ -448,17 +501,21 @@ libcamera::Stream *LibcameraApp::GetMainStream() const
 	return nullptr;
 }
 
-std::vector<libcamera::Span<uint8_t>> LibcameraApp::Mmap(FrameBuffer *buffer) const
+std::vector<libcamera::Span<uint8_t>> const &LibcameraApp::MappedPlanes(FrameBuffer *buffer) const
 {
-	auto item = mapped_buffers_.find(buffer);
-	if (item == mapped_buffers_.end())
-		return {};
-	return item->second;
+	static const std::vector<libcamera::Span<uint8_t>> none;
+	if (!buffer || buffer->cookie() >= mapped_buffers_.size())
+		return none;
+	MappedBuffer const &mapped_buffer = mapped_buffers_[buffer->cookie()];
+	return mapped_buffer.buffer == buffer ? mapped_buffer.planes : none;
 }
 
 void LibcameraApp::SetControls(ControlList &controls)
 {
+	// Keep anything set earlier that hasn't been sent to the camera yet, unless these
+	// controls replace it.
 	std::lock_guard<std::mutex> lock(control_mutex_);
+	controls.merge(controls_);
 	controls_ = std::move(controls);
 }
 
@@ -483,38 +540,30 @@ void LibcameraApp::setupCapture()
 	else if (validation == CameraConfiguration::Adjusted)
 		std::cerr << "Stream configuration adjusted" << std::endl;
 
-	if (camera_->configure(configuration_.get()) < 0)
+	if (frame_source_)
+		frame_source_->Configure(configuration_.get());
+	else if (camera_->configure(configuration_.get()) < 0)
 		throw std::runtime_error("failed to configure streams");
 	if (options_->verbose)
 		std::cerr << "Camera streams configured" << std::endl;
 
 	// Next allocate all the buffers we need, mmap them and store them on a free list.
 
-	allocator_ = new FrameBufferAllocator(camera_);
-	for (StreamConfiguration &config : *configuration_)
+	if (frame_source_)
+		frame_source_->AllocateBuffers();
+	else
+		allocator_ = new FrameBufferAllocator(camera_);
+	for (unsigned int i = 0; i < configuration_->size(); i++)
 	{
-		Stream *stream = config.stream();
+		Stream *stream = configuredStream(i);
 
-		if (allocator_->allocate(stream) < 0)
+		if (allocator_ && allocator_->allocate(stream) < 0)
 			throw std::runtime_error("failed to allocate capture buffers");
 
-		for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(stream))
+		for (const std::unique_ptr<FrameBuffer> &buffer :
+			 allocator_ ? allocator_->buffers(stream) : frame_source_->Buffers(stream))
 		{
-			// "Single plane" buffers appear as multi-plane here, but we can spot them because then
-			// planes all share the same fd. We accumulate them so as to mmap the buffer only once.
-			size_t buffer_size = 0;
-			for (unsigned i = 0; i < buffer->planes().size(); i++)
-			{
-				const FrameBuffer::Plane &plane = buffer->planes()[i];
-				buffer_size += plane.length;
-				if (i == buffer->planes().size() - 1 || plane.fd.get() != buffer->planes()[i + 1].fd.get())
-				{
-					void *memory = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
-					mapped_buffers_[buffer.get()].push_back(
-						libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), buffer_size));
-					buffer_size = 0;
-				}
-			}
+			mapBuffer(buffer.get());
 			frame_buffers_[stream].push(buffer.get());
 		}
 	}
@@ -524,6 +573,33 @@ void LibcameraApp::setupCapture()
 	// The requests will be made when StartCamera() is called.
 }
 
+void LibcameraApp::mapBuffer(FrameBuffer *buffer)
+{
+	buffer->setCookie(mapped_buffers_.size());
+	MappedBuffer &mapped_buffer = mapped_buffers_.emplace_back(MappedBuffer { buffer, {} });
+
+	// "Single plane" buffers appear as multi-plane here, but we can spot them because then
+	// planes all share the same fd. We accumulate them so as to mmap the buffer only once.
+	size_t buffer_size = 0;
+	for (unsigned i = 0; i < buffer->planes().size(); i++)
+	{
+		const FrameBuffer::Plane &plane = buffer->planes()[i];
+		buffer_size += plane.length;
+		if (i == buffer->planes().size() - 1 || plane.fd.get() != buffer->planes()[i + 1].fd.get())
+		{
+			void *memory = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
+			mapped_buffer.planes.push_back(libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), buffer_size));
+			buffer_size = 0;
+		}
+	}
+}
+
+libcamera::Stream *LibcameraApp::configuredStream(unsigned int index) const
+{
+	// Only a real camera can tell the StreamConfiguration which Stream it got.
+	return frame_source_ ? frame_source_->GetStream(index) : configuration_->at(index).stream();
+}
+
 void LibcameraApp::makeRequests()
 {
 	auto free_buffers(frame_buffers_);
@@ -536,11 +612,12 @@ void LibcameraApp::makeRequests()
 			{
 				if (free_buffers[stream].empty())
 				{
+					makeCompletedRequests(requests_.size());
 					if (options_->verbose)
 						std::cerr << "Requests created" << std::endl;
 					return;
 				}
-				std::unique_ptr<Request> request = camera_->createRequest();
+				std::unique_ptr<Request> request = camera_->createRequest(requests_.size());
 				if (!request)
 					throw std::runtime_error("failed to make request");
 				requests_.push_back(std::move(request));
@@ -556,29 +633,90 @@ void LibcameraApp::makeRequests()
 	}
 }
 
+void LibcameraApp::makeCompletedRequests(size_t count)
+{
+	std::lock_guard<std::mutex> lock(camera_stop_mutex_);
+
+	if (completed_requests_.size() < count)
+		completed_requests_.resize(count);
+
+	for (unsigned int i = 0; i < completed_requests_.size(); i++)
+	{
+		std::unique_ptr<CompletedRequest> &completed_request = completed_requests_[i];
+		// Anything still held from before a restart is left for its last user to delete.
+		if (completed_request && completed_request->refcount.load(std::memory_order_acquire))
+		{
+			completed_request->orphaned = true;
+			completed_request.release();
+		}
+		if (!completed_request)
+			completed_request = std::make_unique<CompletedRequest>(
+				[this](CompletedRequest *cr) { this->queueRequest(cr); });
+		completed_request->index = i;
+	}
+}
+
 void LibcameraApp::requestComplete(Request *request)
 {
 	if (request->status() == Request::RequestCancelled)
 		return;
 
-	CompletedRequest *r = new CompletedRequest(sequence_++, request->buffers(), request->metadata());
- 	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
- 	known_completed_requests_.insert(r);
+	// Refill this request's CompletedRequest in place; assigning into the existing buffer
+	// map and control list reuses their storage, so nothing is allocated here.
+	CompletedRequest *r = completed_requests_[request->cookie()].get();
+	r->buffers = request->buffers();
+	r->metadata = request->metadata();
+	r->timestamp = r->buffers.begin()->second->metadata().timestamp;
+	r->request = request;
+	request->reuse(Request::ReuseBuffers);
+
+	completeRequest(r);
+}
+
+void LibcameraApp::sourceFrameComplete(unsigned int index, uint64_t timestamp)
+{
+	// Fill in what the camera would have told us about the frame.
+	CompletedRequest *r = completed_requests_[index].get();
+	r->buffers = frame_source_->SlotBuffers(index);
+	r->metadata.clear();
+	r->metadata.set(controls::SensorTimestamp, static_cast<int64_t>(timestamp));
+	r->metadata.set(controls::FrameDuration, frame_source_->FrameDuration());
+	r->timestamp = timestamp;
+	r->request = nullptr;
+
+	completeRequest(r);
+}
+
+void LibcameraApp::completeRequest(CompletedRequest *r)
+{
+	// The frame source starts a new thread every time, so we check which one this is.
+	if (completion_cpu_ >= 0 && completion_thread_ != std::this_thread::get_id())
 	{
-		request->reuse();
-		std::lock_guard<std::mutex> lock(free_requests_mutex_);
-		free_requests_.push(request);
+		completion_thread_ = std::this_thread::get_id();
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(completion_cpu_, &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+			std::cerr << "WARNING: failed to pin request completion to CPU " << completion_cpu_ << std::endl;
+		else if (options_->verbose)
+			std::cerr << "Request completion pinned to CPU " << completion_cpu_ << std::endl;
 	}
 
+	r->sequence = sequence_++;
+	r->post_process_metadata.Clear();
+	r->generation = generation_;
+	CompletedRequestPtr payload(r);
+	FrameTrace::Begin(r->timestamp / 1000);
+
 	// We calculate the instantaneous framerate in case anyone wants it.
-	uint64_t timestamp = payload->buffers.begin()->second->metadata().timestamp;
+	uint64_t timestamp = payload->timestamp;
 	if (last_timestamp_ == 0 || last_timestamp_ == timestamp)
 		payload->framerate = 0;
 	else
 		payload->framerate = 1e9 / (timestamp - last_timestamp_);
 	last_timestamp_ = timestamp;
 
-	post_processor_.Process(payload); // post-processor can re-use our shared_ptr
+	post_processor_.Process(payload); // post-processor can re-use our reference
 }
 
 void LibcameraApp::configureDenoise(const std::string &denoise_mode)
@@ -9,12 +9,12 @@
 
 #include <sys/mman.h>
 
+#include <atomic>
 #include <condition_variable>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <queue>
-#include <set>
 #include <string>
 #include <thread>
 #include <variant>
@@ -29,6 +29,8 @@
 #include <libcamera/property_ids.h>
 
 #include "core/completed_request.hpp"
+#include "core/frame_source.hpp"
+#include "core/message_queue.hpp"
 #include "core/post_processor.hpp"
 
 struct Options;
@@ -101,6 +103,8 @@ public:
 	void StopCamera();
 
 	Msg Wait();
+	// Wait for at least one message, then collect any others already queued, up to max.
+	size_t WaitMany(std::vector<Msg> &msgs, size_t max);
 	void PostMessage(MsgType &t, MsgPayload &p);
 
 	Stream *GetStream(std::string const &name, unsigned int *w = nullptr, unsigned int *h = nullptr,
@@ -113,72 +117,63 @@ public:
 	Stream *LoresStream(unsigned int *w = nullptr, unsigned int *h = nullptr, unsigned int *stride = nullptr) const;
 	Stream *GetMainStream() const;
 
-	std::vector<libcamera::Span<uint8_t>> Mmap(FrameBuffer *buffer) const;
+	// Returns a reference to the buffer's precomputed plane mappings, without allocating.
+	std::vector<libcamera::Span<uint8_t>> const &MappedPlanes(FrameBuffer *buffer) const;
+	std::vector<libcamera::Span<uint8_t>> Mmap(FrameBuffer *buffer) const { return MappedPlanes(buffer); }
 
 	void SetControls(ControlList &controls);
+	// Pin whichever thread completes requests (libcamera's, or the frame source's) to this
+	// CPU, or -1 to leave it alone.
+	void SetCompletionCpu(int cpu) { completion_cpu_ = cpu; }
 	void StreamDimensions(Stream const *stream, unsigned int *w, unsigned int *h, unsigned int *stride) const;
 
 protected:
 	std::unique_ptr<Options> options_;
 
 private:
-	template <typename T>
-	class MessageQueue
-	{
-	public:
-		template <typename U>
-		void Post(U &&msg)
-		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_.push(std::forward<U>(msg));
-			cond_.notify_one();
-		}
-		T Wait()
-		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			cond_.wait(lock, [this] { return !queue_.empty(); });
-			T msg = std::move(queue_.front());
-			queue_.pop();
-			return msg;
-		}
-		void Clear()
-		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_ = {};
-		}
-
-	private:
-		std::queue<T> queue_;
-		std::mutex mutex_;
-		std::condition_variable cond_;
-	};
-	
+	void acquireCamera();
 	void setupCapture();
+	void mapBuffer(FrameBuffer *buffer);
+	Stream *configuredStream(unsigned int index) const;
 	void makeRequests();
+	void makeCompletedRequests(size_t count);
 	void queueRequest(CompletedRequest *completed_request);
 	void requestComplete(Request *request);
+	void sourceFrameComplete(unsigned int index, uint64_t timestamp);
+	void completeRequest(CompletedRequest *completed_request);
 	void configureDenoise(const std::string &denoise_mode);
 
 	std::unique_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
+	std::unique_ptr<FrameSource> frame_source_; // used instead of camera_ if set
 	bool camera_acquired_ = false;
 	std::unique_ptr<CameraConfiguration> configuration_;
-	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
+	struct MappedBuffer
+	{
+		FrameBuffer *buffer;
+		std::vector<libcamera::Span<uint8_t>> planes;
+	};
+	// Indexed by the buffer's cookie, which setupCapture assigns.
+	std::vector<MappedBuffer> mapped_buffers_;
 	std::map<std::string, Stream *> streams_;
 	FrameBufferAllocator *allocator_ = nullptr;
 	std::map<Stream *, std::queue<FrameBuffer *>> frame_buffers_;
-	std::mutex free_requests_mutex_;
-	std::queue<Request *> free_requests_;
 	std::vector<std::unique_ptr<Request>> requests_;
-	std::set<CompletedRequest *> known_completed_requests_;
+	// One CompletedRequest per Request, indexed by the request's cookie. A new generation
+	// starts every time the camera stops, so that stale ones are never re-queued.
+	std::vector<std::unique_ptr<CompletedRequest>> completed_requests_;
+	std::atomic<uint64_t> generation_ = 0;
 	bool camera_started_ = false;
 	std::mutex camera_stop_mutex_;
 	MessageQueue<Msg> msg_queue_;
+	uint64_t reported_overflows_ = 0;
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
 	// Other:
 	uint64_t last_timestamp_;
 	uint64_t sequence_ = 0;
+	int completion_cpu_ = -1;
+	std::thread::id completion_thread_; // the last one we pinned
 	PostProcessor post_processor_;
 };
@@ -5,6 +5,11 @@
  * libcamera_encoder.cpp - libcamera video encoding class.
  */
 
+#include <algorithm>
+#include <deque>
+#include <utility>
+
+#include "core/frame_trace.hpp"
 #include "core/libcamera_app.hpp"
 #include "core/video_options.hpp"
 #include "encoder/encoder.hpp"
@@ -24,28 +29,43 @@ public:
 		createEncoder();
 		encoder_->SetInputDoneCallback(std::bind(&LibcameraEncoder::encodeBufferDone, this, std::placeholders::_1));
 		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		encoder_->SetFrameDroppedCallback(frame_dropped_callback_);
+		if (buffer_ready_callback_)
+			encoder_->SetBufferReadyCallback(buffer_ready_callback_);
 	}
 	// This is callback when the encoder gives you the encoded output data.
 	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
+	// This is called for each frame the encoder drops, by timestamp.
+	void SetFrameDroppedCallback(FrameDroppedCallback callback) { frame_dropped_callback_ = callback; }
+	// To be handed the camera buffers themselves, where the encoder only passes them through.
+	// Each one must then be given back with ReleaseBuffer.
+	void SetBufferReadyCallback(BufferReadyCallback callback) { buffer_ready_callback_ = callback; }
+	void ReleaseBuffer(void *mem) { encodeBufferDone(mem); }
 	void EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
 		assert(encoder_);
 		unsigned int w, h, stride;
 		StreamDimensions(stream, &w, &h, &stride);
 		FrameBuffer *buffer = completed_request->buffers[stream];
-		libcamera::Span span = Mmap(buffer)[0];
+		libcamera::Span span = MappedPlanes(buffer)[0];
 		void *mem = span.data();
 		if (!buffer || !mem)
 			throw std::runtime_error("no buffer to encode");
-		int64_t timestamp_ns = buffer->metadata().timestamp;
+		int64_t timestamp_ns = completed_request->timestamp;
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			encode_buffer_queue_.emplace_back(mem, completed_request); // creates a new reference
 		}
+		FrameTrace::Record(timestamp_ns / 1000, FrameTrace::ENCODE_QUEUED);
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, w, h, stride, timestamp_ns / 1000);
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(options_.get()); }
 	void StopEncoder() { encoder_.reset(); }
+	void SetEncoderQuality(int quality)
+	{
+		if (encoder_)
+			encoder_->SetQuality(quality);
+	}
 
 protected:
 	virtual void createEncoder() { encoder_ = std::unique_ptr<Encoder>(Encoder::Create(GetOptions())); }
@@ -54,20 +74,22 @@ protected:
 private:
 	void encodeBufferDone(void *mem)
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
-		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
-				throw std::runtime_error("no buffer available to return");
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
-		}
+		// A NULL mem means the oldest buffer, for encoders that finish in order. Otherwise it
+		// tells us which buffer is done, as encoders that run several frames at once may return
+		// them in any order.
+		std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+		auto it = encode_buffer_queue_.begin();
+		if (mem)
+			it = std::find_if(encode_buffer_queue_.begin(), encode_buffer_queue_.end(),
+							  [mem](auto const &entry) { return entry.first == mem; });
+		if (it == encode_buffer_queue_.end())
+			throw std::runtime_error("no buffer available to return");
+		encode_buffer_queue_.erase(it); // drop shared_ptr reference
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
+	std::deque<std::pair<void *, CompletedRequestPtr>> encode_buffer_queue_;
 	std::mutex encode_buffer_queue_mutex_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
+	FrameDroppedCallback frame_dropped_callback_;
+	BufferReadyCallback buffer_ready_callback_;
 };
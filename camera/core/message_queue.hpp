@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * message_queue.hpp - bounded lock-free message queue.
+ */
+
+#pragma once
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+// A bounded multi-producer, single-consumer ring of preallocated slots. Producers never
+// block and never allocate: if the ring is full the message is refused and counted as
+// an overflow, rather than letting the queue grow without limit. The consumer only
+// sleeps (on an eventfd) when the ring is empty, and producers only make a syscall to
+// wake it when it has actually gone to sleep.
+template <typename T>
+class MessageQueue
+{
+public:
+	MessageQueue(size_t capacity = 16) : overflows_(0), head_(0), tail_(0), waiting_(false)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+		mask_ = size - 1;
+		slots_ = std::make_unique<Slot[]>(size);
+		for (size_t i = 0; i < size; i++)
+			slots_[i].sequence.store(i, std::memory_order_relaxed);
+
+		event_fd_ = eventfd(0, EFD_CLOEXEC);
+		if (event_fd_ < 0)
+			throw std::runtime_error("failed to create message queue eventfd");
+	}
+	~MessageQueue() { close(event_fd_); }
+
+	// Returns false (and drops the message) if the consumer has fallen too far behind.
+	template <typename U>
+	bool Post(U &&msg)
+	{
+		size_t pos = head_.load(std::memory_order_relaxed);
+		Slot *slot;
+		while (true)
+		{
+			slot = &slots_[pos & mask_];
+			size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+			if (diff == 0)
+			{
+				if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				overflows_.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			else
+				pos = head_.load(std::memory_order_relaxed);
+		}
+
+		slot->value.emplace(std::forward<U>(msg));
+		slot->sequence.store(pos + 1, std::memory_order_release);
+
+		// Pairs with the fence in sleep(): either the consumer sees this message when it
+		// re-checks the ring, or we see that it is waiting and wake it.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting_.exchange(false))
+		{
+			uint64_t one = 1;
+			[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
+		}
+		return true;
+	}
+
+	T Wait()
+	{
+		std::optional<T> msg;
+		while (!(msg = tryPop()))
+			sleep();
+		return std::move(*msg);
+	}
+
+	// Wait for at least one message, then take as many more as are ready, up to max.
+	size_t WaitMany(std::vector<T> &msgs, size_t max)
+	{
+		msgs.clear();
+		msgs.push_back(Wait());
+		while (msgs.size() < max)
+		{
+			std::optional<T> msg = tryPop();
+			if (!msg)
+				break;
+			msgs.push_back(std::move(*msg));
+		}
+		return msgs.size();
+	}
+
+	// Only the consumer may call this.
+	void Clear()
+	{
+		while (tryPop())
+		{
+		}
+	}
+
+	uint64_t Overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+private:
+	struct Slot
+	{
+		std::atomic<size_t> sequence;
+		std::optional<T> value;
+	};
+
+	std::optional<T> tryPop()
+	{
+		size_t pos = tail_.load(std::memory_order_relaxed);
+		Slot &slot = slots_[pos & mask_];
+		if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+			return std::nullopt;
+
+		std::optional<T> msg(std::move(slot.value));
+		slot.value.reset();
+		slot.sequence.store(pos + mask_ + 1, std::memory_order_release);
+		tail_.store(pos + 1, std::memory_order_relaxed);
+		return msg;
+	}
+
+	bool empty() const
+	{
+		size_t pos = tail_.load(std::memory_order_relaxed);
+		return slots_[pos & mask_].sequence.load(std::memory_order_acquire) != pos + 1;
+	}
+
+	void sleep()
+	{
+		waiting_.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!empty())
+		{
+			waiting_.store(false);
+			return;
+		}
+
+		uint64_t value;
+		while (read(event_fd_, &value, sizeof(value)) < 0 && errno == EINTR)
+		{
+		}
+	}
+
+	std::unique_ptr<Slot[]> slots_;
+	size_t mask_;
+	std::atomic<uint64_t> overflows_;
+	alignas(64) std::atomic<size_t> head_;
+	alignas(64) std::atomic<size_t> tail_;
+	alignas(64) std::atomic<bool> waiting_;
+	int event_fd_;
+};
@@ -59,6 +59,29 @@ bool Options::Parse(int argc, char *argv[])
     if (sscanf(roi.c_str(), "%f,%f,%f,%f", &roi_x, &roi_y, &roi_width, &roi_height) != 4)
       roi_x = roi_y = roi_width = roi_height = 0; // don't set digital zoom
 
+    UpdateControlIndices();
+
+    if (sscanf(awbgains.c_str(), "%f,%f", &awb_gain_r, &awb_gain_b) != 2)
+      throw std::runtime_error("Invalid AWB gains");
+
+    post_process_threads = std::max(post_process_threads, 1u);
+    post_process_depth = std::max(post_process_depth, post_process_threads);
+
+    brightness = std::clamp(brightness, -1.0f, 1.0f);
+    contrast = std::clamp(contrast, 0.0f, 15.99f); // limits are arbitrary..
+    saturation = std::clamp(saturation, 0.0f, 15.99f); // limits are arbitrary..
+    sharpness = std::clamp(sharpness, 0.0f, 15.99f); // limits are arbitrary..
+
+    // We have to pass the tuning file name through an environment variable.
+    // Note that we only overwrite the variable if the option was given.
+    if (tuning_file != "-")
+      setenv("LIBCAMERA_RPI_TUNING_FILE", tuning_file.c_str(), 1);
+
+    return true;
+}
+
+void Options::UpdateControlIndices()
+{
     std::map<std::string, int> metering_table =
       { { "centre", libcamera::controls::MeteringCentreWeighted },
         { "spot", libcamera::controls::MeteringSpot },
@@ -93,21 +116,6 @@ bool Options::Parse(int argc, char *argv[])
     if (awb_table.count(awb) == 0)
       throw std::runtime_error("Invalid AWB mode: " + awb);
     awb_index = awb_table[awb];
-
-    if (sscanf(awbgains.c_str(), "%f,%f", &awb_gain_r, &awb_gain_b) != 2)
-      throw std::runtime_error("Invalid AWB gains");
-
-    brightness = std::clamp(brightness, -1.0f, 1.0f);
-    contrast = std::clamp(contrast, 0.0f, 15.99f); // limits are arbitrary..
-    saturation = std::clamp(saturation, 0.0f, 15.99f); // limits are arbitrary..
-    sharpness = std::clamp(sharpness, 0.0f, 15.99f); // limits are arbitrary..
-
-    // We have to pass the tuning file name through an environment variable.
-    // Note that we only overwrite the variable if the option was given.
-    if (tuning_file != "-")
-      setenv("LIBCAMERA_RPI_TUNING_FILE", tuning_file.c_str(), 1);
-
-    return true;
 }
 
 void Options::Print() const
@@ -122,6 +130,11 @@ void Options::Print() const
     std::cout << "    height: " << height << std::endl;
     std::cout << "    output: " << output << std::endl;
     std::cout << "    post_process_file: " << post_process_file << std::endl;
+    std::cout << "    post_process_threads: " << post_process_threads << std::endl;
+    std::cout << "    post_process_depth: " << post_process_depth << std::endl;
+    std::cout << "    source: " << source << std::endl;
+    if (!trace_file.empty())
+      std::cout << "    trace: " << trace_file << " (" << trace_frames << " frames)" << std::endl;
     std::cout << "    rawfull: " << rawfull << std::endl;
     std::cout << "    transform: " << transformToString(transform) << std::endl;
     if (roi_width == 0 || roi_height == 0)
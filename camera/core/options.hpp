@@ -53,6 +53,10 @@ struct Options
        "Set the output file name")
       ("post-process-file", value<std::string>(&post_process_file),
        "Set the file name for configuring the post-processing")
+      ("post-process-threads", value<unsigned int>(&post_process_threads)->default_value(2),
+       "Number of worker threads running the post-processing stages")
+      ("post-process-depth", value<unsigned int>(&post_process_depth)->default_value(4),
+       "Maximum number of requests in flight through the post-processing stages")
       ("rawfull", value<bool>(&rawfull)->default_value(false)->implicit_value(true),
        "Force use of full resolution raw frames")
       ("hflip", value<bool>(&hflip_)->default_value(false)->implicit_value(true), "Request a horizontal flip transform")
@@ -97,6 +101,14 @@ struct Options
        "Height of viewfinder frames from the camera (distinct from the preview window size)")
       ("tuning-file", value<std::string>(&tuning_file)->default_value("-"),
        "Name of camera tuning file to use, omit this option for libcamera default behaviour")
+      ("source", value<std::string>(&source)->default_value("camera"),
+       "Where frames come from: camera, pattern (a generated test pattern) or the name of a raw "
+       "YUV420 file, holding frames of the output size, to play on a loop at the framerate")
+      ("trace-file", value<std::string>(&trace_file),
+       "Record per-frame latency through the pipeline, and write it to this file as Chrome trace JSON "
+       "when the stream stops")
+      ("trace-frames", value<unsigned int>(&trace_frames)->default_value(1024),
+       "Number of most recent frames to keep latency traces for")
       ("lores-width", value<unsigned int>(&lores_width)->default_value(0),
        "Width of low resolution frames (use 0 to omit low resolution stream")
       ("lores-height", value<unsigned int>(&lores_height)->default_value(0),
@@ -114,6 +126,8 @@ struct Options
   std::string config_file;
   std::string output;
   std::string post_process_file;
+  unsigned int post_process_threads;
+  unsigned int post_process_depth;
   unsigned int width;
   unsigned int height;
   bool rawfull;
@@ -144,6 +158,9 @@ struct Options
   unsigned int viewfinder_width;
   unsigned int viewfinder_height;
   std::string tuning_file;
+  std::string source;
+  std::string trace_file;
+  unsigned int trace_frames;
   unsigned int lores_width;
   unsigned int lores_height;
 
@@ -151,6 +168,9 @@ struct Options
 
   virtual bool Parse(int argc, char *argv[]);
   virtual void Print() const;
+  // Look up the metering, exposure and AWB control values from their names again, for
+  // when those are changed after parsing. Throws if any name is not recognised.
+  void UpdateControlIndices();
 
 protected:
   boost::program_options::options_description options_;
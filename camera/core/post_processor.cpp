@@ -5,9 +5,12 @@
  * post_processor.cpp - Post processor implementation.
  */
 
+#include <algorithm>
 #include <iostream>
 
+#include "core/frame_trace.hpp"
 #include "core/libcamera_app.hpp"
+#include "core/options.hpp"
 #include "core/post_processor.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -70,9 +73,21 @@ void PostProcessor::Configure()
 
 void PostProcessor::Start()
 {
+	Options const *options = app_->GetOptions();
+
 	quit_ = false;
+	max_in_flight_ = options->post_process_depth;
+	stats_ = {};
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
 
+	// The workers persist for as long as the camera runs, so there's no per-frame cost
+	// in creating threads.
+	if (!stages_.empty())
+	{
+		for (unsigned int i = 0; i < options->post_process_threads; i++)
+			workers_.emplace_back(&PostProcessor::workerThread, this);
+	}
+
 	for (auto &stage : stages_)
 	{
 		stage->Start();
@@ -88,27 +103,58 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 	}
 
 	std::unique_lock<std::mutex> l(mutex_);
-	requests_.push(std::move(request)); // caller has given us ownership of this reference
 
-	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
+	// Bound the number of requests in flight. Waiting here holds the buffers back from the
+	// camera rather than letting work pile up behind a slow stage.
+	space_cv_.wait(l, [this] { return jobs_.size() < max_in_flight_; });
+
+	// Caller has given us ownership of this reference.
+	jobs_.push_back({ std::move(request), Job::State::Queued, false, std::chrono::steady_clock::now() });
+	stats_.max_depth = std::max<unsigned int>(stats_.max_depth, jobs_.size());
+	work_cv_.notify_one();
+}
+
+void PostProcessor::workerThread()
+{
+	std::unique_lock<std::mutex> l(mutex_);
+
+	while (true)
+	{
+		auto it = jobs_.end();
+		work_cv_.wait(l, [this, &it] {
+			it = std::find_if(jobs_.begin(), jobs_.end(),
+							  [](Job const &job) { return job.state == Job::State::Queued; });
+			return quit_ || it != jobs_.end();
+		});
+
+		// Only quit once every queued job has been picked up.
+		if (it == jobs_.end())
+			break;
+
+		// References into a deque survive push_back, and only finished jobs are popped
+		// from the front, so this stays valid while we run unlocked.
+		Job &job = *it;
+		job.state = Job::State::Running;
+		auto wait = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+																		  job.queued_time);
+		stats_.total_wait += wait;
+		stats_.max_wait = std::max(stats_.max_wait, wait);
+		l.unlock();
+
 		bool drop_request = false;
-		for (auto &stage : stages_)
+		int64_t timestamp_us = job.request->timestamp / 1000;
+		for (unsigned int i = 0; i < stages_.size() && !drop_request; i++)
 		{
-			if (stage->Process(request))
-			{
-				drop_request = true;
-				break;
-			}
+			FrameTrace::Record(timestamp_us, FrameTrace::STAGE_START, i);
+			drop_request = stages_[i]->Process(job.request);
+			FrameTrace::Record(timestamp_us, FrameTrace::STAGE_END, i);
 		}
-		promise.set_value(drop_request);
-		cv_.notify_one();
-	};
 
-	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
-	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
-	futures_.push(promise.get_future());
-	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
+		l.lock();
+		job.drop_request = drop_request;
+		job.state = Job::State::Done;
+		cv_.notify_one();
+	}
 }
 
 void PostProcessor::outputThread()
@@ -122,18 +168,18 @@ void PostProcessor::outputThread()
 			std::unique_lock<std::mutex> l(mutex_);
 
 			cv_.wait(l, [this] {
-				return (quit_ && futures_.empty()) ||
-					   (!futures_.empty() && futures_.front().wait_for(0s) == std::future_status::ready);
+				return (quit_ && jobs_.empty()) || (!jobs_.empty() && jobs_.front().state == Job::State::Done);
 			});
 
-			// Only quit when the futures_ queue is empty.
-			if (quit_ && futures_.empty())
+			// Only quit when the jobs_ queue is empty.
+			if (quit_ && jobs_.empty())
 				break;
 
-			drop_request = futures_.front().get();
-			futures_.pop();
-			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
-			requests_.pop();
+			drop_request = jobs_.front().drop_request;
+			request = std::move(jobs_.front().request); // reuse as it's being dropped from the queue
+			jobs_.pop_front();
+			stats_.frames++;
+			space_cv_.notify_one();
 		}
 
 		if (!drop_request)
@@ -151,10 +197,28 @@ void PostProcessor::Stop()
 	{
 		std::unique_lock<std::mutex> l(mutex_);
 		quit_ = true;
+		work_cv_.notify_all();
 		cv_.notify_one();
 	}
 
+	for (auto &worker : workers_)
+		worker.join();
+	workers_.clear();
+
 	output_thread_.join();
+
+	if (app_->GetOptions()->verbose && stats_.frames)
+		std::cerr << "PostProcessor: " << stats_.frames << " frames, max depth " << stats_.max_depth << "/"
+				  << max_in_flight_ << ", average wait " << stats_.total_wait.count() / stats_.frames
+				  << " us, max wait " << stats_.max_wait.count() << " us" << std::endl;
+}
+
+PostProcessor::Stats PostProcessor::GetStats() const
+{
+	std::unique_lock<std::mutex> l(mutex_);
+	Stats stats = stats_;
+	stats.depth = jobs_.size();
+	return stats;
 }
 
 void PostProcessor::Teardown()
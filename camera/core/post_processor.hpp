@@ -9,9 +9,11 @@
 
 #include <chrono>
 #include <condition_variable>
-#include <future>
+#include <deque>
+#include <functional>
 #include <mutex>
-#include <queue>
+#include <thread>
+#include <vector>
 
 #include "core/completed_request.hpp"
 
@@ -31,6 +33,16 @@ typedef std::unique_ptr<PostProcessingStage> StagePtr;
 class PostProcessor
 {
 public:
+	// Occupancy of the worker pool, and how long requests waited for a free worker.
+	struct Stats
+	{
+		uint64_t frames;
+		unsigned int depth;
+		unsigned int max_depth;
+		std::chrono::microseconds total_wait;
+		std::chrono::microseconds max_wait;
+	};
+
 	PostProcessor(LibcameraApp *app);
 
 	~PostProcessor();
@@ -51,18 +63,41 @@ public:
 
 	void Teardown();
 
+	Stats GetStats() const;
+
 private:
 	PostProcessingStage *createPostProcessingStage(char const *name);
 
 	LibcameraApp *app_;
 	std::vector<StagePtr> stages_;
+	void workerThread();
 	void outputThread();
 
-	std::queue<CompletedRequestPtr> requests_;
-	std::queue<std::future<bool>> futures_;
+	// Requests in flight, in the order they arrived. Workers pick up the oldest queued
+	// job, and the output thread only ever releases the job at the front, so results
+	// still come out in order even though they may be processed out of order.
+	struct Job
+	{
+		enum class State
+		{
+			Queued,
+			Running,
+			Done
+		};
+		CompletedRequestPtr request;
+		State state;
+		bool drop_request;
+		std::chrono::steady_clock::time_point queued_time;
+	};
+	std::deque<Job> jobs_;
+	unsigned int max_in_flight_;
+	std::vector<std::thread> workers_;
 	std::thread output_thread_;
 	bool quit_;
 	PostProcessorCallback callback_;
-	std::mutex mutex_;
+	mutable std::mutex mutex_;
 	std::condition_variable cv_;
+	std::condition_variable work_cv_;
+	std::condition_variable space_cv_;
+	Stats stats_;
 };
@@ -37,8 +37,55 @@ struct VideoOptions : public Options
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
+			("mjpeg-strips", value<unsigned int>(&mjpeg_strips)->default_value(1),
+			 "Split each frame into this many strips that are encoded in parallel (mjpeg only)")
+			("encode-threads", value<unsigned int>(&encode_threads)->default_value(0),
+			 "Number of threads encoding frames, 0 for one per CPU core (mjpeg only)")
+			("encode-adaptive", value<bool>(&encode_adaptive)->default_value(false)->implicit_value(true),
+			 "Use only as many of the encode threads as it takes to keep up, each pinned to a CPU core "
+			 "(mjpeg only)")
+			("encode-reserve-cpu", value<int>(&encode_reserve_cpu)->default_value(0),
+			 "CPU core that requests complete on, which adaptive encode threads keep off, -1 to keep no CPU for it")
+			("encode-queue-depth", value<unsigned int>(&encode_queue_depth)->default_value(0),
+			 "Drop the oldest waiting frames to keep at most this many queued for encoding, 0 for no limit (mjpeg only)")
+			("max-frame-age", value<unsigned int>(&max_frame_age)->default_value(0),
+			 "Drop frames that have waited longer than this many ms to be encoded, 0 for no limit (mjpeg only)")
 			("listen,l", value<bool>(&listen)->default_value(false)->implicit_value(true),
-			 "Listen for an incoming client network connection before sending data to the client")
+			 "Serve tcp:// output to any number of clients that connect, rather than connecting to a server")
+			("client-queue", value<uint32_t>(&client_queue)->default_value(4),
+			 "Frames to queue for each client of a listening tcp:// output, beyond which a slow client skips frames")
+			("http-fps", value<uint32_t>(&http_fps)->default_value(0),
+			 "Frame rate cap for clients of an http:// output that don't ask for one, 0 for every frame")
+			("sndbuf", value<uint32_t>(&sndbuf)->default_value(0),
+			 "Set the network socket's send buffer to this many bytes, ideally enough for a whole frame, "
+			 "0 for the system default")
+			("reconnect", value<bool>(&reconnect)->default_value(false)->implicit_value(true),
+			 "Keep trying to connect a tcp:// or sck:// output in the background, dropping frames until it "
+			 "connects, rather than giving up")
+			("reconnect-max", value<uint32_t>(&reconnect_max)->default_value(5000),
+			 "Longest wait, in ms, between attempts to reconnect, as the waits double from 100ms")
+			("udp-header", value<bool>(&udp_header)->default_value(false)->implicit_value(true),
+			 "Send UDP frames as fragments that each start with a small header (frame id, fragment index and "
+			 "count, timestamp), instead of in PUB framing")
+			("udp-payload", value<uint32_t>(&udp_payload)->default_value(1400),
+			 "Bytes of frame data in each UDP fragment, with --udp-header")
+			("udp-gso", value<bool>(&udp_gso)->default_value(false)->implicit_value(true),
+			 "Have the kernel split UDP fragments into datagrams (UDP_SEGMENT), with --udp-header")
+			("rtp-mtu", value<uint32_t>(&rtp_mtu)->default_value(1400),
+			 "Largest RTP packet, in bytes, for an rtp:// output")
+			("rtp-pace", value<uint32_t>(&rtp_pace)->default_value(50),
+			 "Spread the RTP packets of each frame over this percentage of the frame interval, 0 to send them at once")
+			("sdp", value<std::string>(&sdp)->default_value(""),
+			 "Write the SDP description of an rtp:// output to this file")
+			("output-queue", value<uint32_t>(&output_queue)->default_value(0),
+			 "Queue up to this many KB of frames for a separate output thread, 0 to output them from the "
+			 "encoder's thread")
+			("output-policy", value<std::string>(&output_policy)->default_value("block"),
+			 "What to do when the output queue is full: block, drop-oldest or drop-to-keyframe")
+			("shm-slots", value<uint32_t>(&shm_slots)->default_value(8),
+			 "Number of frames in the shared memory ring of an shm:// output")
+			("shm-slot-size", value<uint32_t>(&shm_slot_size)->default_value(0),
+			 "Largest frame, in KB, that fits a slot of the shared memory ring, 0 for two bytes per pixel")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
 			 "Pause or resume video recording when ENTER pressed")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
@@ -49,8 +96,20 @@ struct VideoOptions : public Options
 			 "Create a new output file every time recording is paused and then resumed")
 			("segment", value<uint32_t>(&segment)->default_value(0),
 			 "Break the recording into files of approximately this many milliseconds")
-			("circular", value<bool>(&circular)->default_value(false)->implicit_value(true),
-			 "Write output to a circular buffer which is saved on exit")
+			("segment-frames", value<uint32_t>(&segment_frames)->default_value(0),
+			 "Break the recording into files of approximately this many frames")
+			("preallocate", value<uint32_t>(&preallocate)->default_value(0),
+			 "Reserve this many MB of disk space for each output file as it is opened")
+			("sync", value<std::string>(&sync)->default_value("none"),
+			 "When to wait for output files to reach the disk: none, segment (as each file is closed) or frame")
+			("circular", value<uint32_t>(&circular)->default_value(0)->implicit_value(4),
+			 "Hold the most recent frames in a circular buffer of this many MB, writing them out only when "
+			 "triggered (by SIGUSR1 with --signal, ENTER with --keypress, a network trigger or detected motion) "
+			 "and when the application exits")
+			("circular-seconds", value<uint32_t>(&circular_seconds)->default_value(0),
+			 "Hold at most this many seconds of frames in the circular buffer, 0 for as many as fit")
+			("circular-post", value<uint32_t>(&circular_post)->default_value(5000),
+			 "After a circular buffer trigger, carry on writing frames out for this many milliseconds")
 			;
 	}
 
@@ -62,14 +121,40 @@ struct VideoOptions : public Options
 	std::string codec;
 	std::string save_pts;
 	int quality;
+	unsigned int mjpeg_strips;
+	unsigned int encode_threads;
+	bool encode_adaptive;
+	int encode_reserve_cpu;
+	unsigned int encode_queue_depth;
+	unsigned int max_frame_age;
 	bool listen;
+	uint32_t client_queue;
+	uint32_t http_fps;
+	uint32_t sndbuf;
+	bool reconnect;
+	uint32_t reconnect_max;
+	bool udp_header;
+	uint32_t udp_payload;
+	bool udp_gso;
+	uint32_t rtp_mtu;
+	uint32_t rtp_pace;
+	std::string sdp;
+	uint32_t output_queue;
+	std::string output_policy;
+	uint32_t shm_slots;
+	uint32_t shm_slot_size;
 	bool keypress;
 	bool signal;
 	std::string initial;
 	bool pause;
 	bool split;
 	uint32_t segment;
-	bool circular;
+	uint32_t segment_frames;
+	uint32_t preallocate;
+	std::string sync;
+	uint32_t circular;
+	uint32_t circular_seconds;
+	uint32_t circular_post;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -88,15 +173,44 @@ struct VideoOptions : public Options
 			codec = "mjpeg";
 		else
 			throw std::runtime_error("unrecognised codec " + codec);
+		if (mjpeg_strips == 0)
+			throw std::runtime_error("mjpeg-strips must be at least 1");
 		if (strcasecmp(initial.c_str(), "pause") == 0)
 			pause = true;
 		else if (strcasecmp(initial.c_str(), "record") == 0)
 			pause = false;
 		else
 			throw std::runtime_error("incorrect initial value " + initial);
+		// Players that join an RTP stream late need the SPS and PPS before every IDR frame.
+		if (output.compare(0, 6, "rtp://") == 0 && codec == "h264")
+			inline_headers = true;
 		if ((pause || split || segment || circular) && !inline_headers)
 			std::cerr << "WARNING: consider inline headers with 'pause'/split/segment/circular" << std::endl;
-		if ((split || segment) && output.find('%') == std::string::npos)
+		if (sync != "none" && sync != "segment" && sync != "frame")
+			throw std::runtime_error("unrecognised sync policy " + sync);
+		if (output_policy != "block" && output_policy != "drop-oldest" && output_policy != "drop-to-keyframe")
+			throw std::runtime_error("unrecognised output policy " + output_policy);
+		if (udp_payload == 0 || udp_payload > 65507 - 24)
+			throw std::runtime_error("udp-payload must be between 1 and 65483");
+		if (client_queue == 0)
+			throw std::runtime_error("client-queue must be at least 1");
+		if (encode_reserve_cpu < -1)
+			throw std::runtime_error("encode-reserve-cpu must be a CPU number, or -1 for none");
+		if (reconnect_max < 100)
+			throw std::runtime_error("reconnect-max must be at least 100");
+		if (shm_slots < 2)
+			throw std::runtime_error("shm-slots must be at least 2");
+		if (output.compare(0, 7, "http://") == 0 && codec != "mjpeg")
+			throw std::runtime_error("http output needs the mjpeg codec");
+		if (output.compare(0, 6, "rtp://") == 0 && codec == "yuv420")
+			throw std::runtime_error("rtp output needs the mjpeg or h264 codec");
+		if (rtp_mtu < 256 || rtp_mtu > 65507)
+			throw std::runtime_error("rtp-mtu must be between 256 and 65507");
+		if (rtp_pace > 100)
+			throw std::runtime_error("rtp-pace must be at most 100");
+		if (output.compare(0, 9, "dmabuf://") == 0 && (codec != "yuv420" || circular || output_queue))
+			throw std::runtime_error("dmabuf output needs the yuv420 codec, and no circular buffer or output queue");
+		if ((split || segment || segment_frames) && output.find('%') == std::string::npos)
 			std::cerr << "WARNING: expected % directive in output filename" << std::endl;
 
 		return true;
@@ -112,11 +226,32 @@ struct VideoOptions : public Options
 		std::cerr << "    save-pts: " << save_pts << std::endl;
 		std::cerr << "    codec: " << codec << std::endl;
 		std::cerr << "    quality (for MJPEG): " << quality << std::endl;
+		std::cerr << "    mjpeg-strips: " << mjpeg_strips << std::endl;
+		std::cerr << "    encode-threads: " << encode_threads << (encode_adaptive ? " (adaptive)" : "") << std::endl;
+		std::cerr << "    encode-reserve-cpu: " << encode_reserve_cpu << std::endl;
+		std::cerr << "    encode-queue-depth: " << encode_queue_depth << std::endl;
+		std::cerr << "    max-frame-age: " << max_frame_age << std::endl;
+		std::cerr << "    listen: " << listen << " (client queue " << client_queue << ")" << std::endl;
+		std::cerr << "    http-fps: " << http_fps << std::endl;
+		std::cerr << "    sndbuf: " << sndbuf << std::endl;
+		std::cerr << "    reconnect: " << reconnect << " (max " << reconnect_max << "ms)" << std::endl;
+		std::cerr << "    udp-header: " << udp_header << " (payload " << udp_payload << (udp_gso ? ", gso" : "") << ")"
+				  << std::endl;
+		std::cerr << "    rtp-mtu: " << rtp_mtu << " (pace " << rtp_pace << "%)" << std::endl;
+		std::cerr << "    sdp: " << sdp << std::endl;
+		std::cerr << "    output-queue: " << output_queue << " (" << output_policy << ")" << std::endl;
+		std::cerr << "    shm-slots: " << shm_slots << std::endl;
+		std::cerr << "    shm-slot-size: " << shm_slot_size << std::endl;
 		std::cerr << "    keypress: " << keypress << std::endl;
 		std::cerr << "    signal: " << signal << std::endl;
 		std::cerr << "    initial: " << initial << std::endl;
 		std::cerr << "    split: " << split << std::endl;
 		std::cerr << "    segment: " << segment << std::endl;
+		std::cerr << "    segment-frames: " << segment_frames << std::endl;
+		std::cerr << "    preallocate: " << preallocate << std::endl;
+		std::cerr << "    sync: " << sync << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
+		std::cerr << "    circular-seconds: " << circular_seconds << std::endl;
+		std::cerr << "    circular-post: " << circular_post << std::endl;
 	}
 };
@@ -13,6 +13,8 @@
 
 typedef std::function<void(void *)> InputDoneCallback;
 typedef std::function<void(void *, size_t, int64_t, bool)> OutputReadyCallback;
+typedef std::function<void(int64_t)> FrameDroppedCallback;
+typedef std::function<void(void *, int, size_t, unsigned int, unsigned int, unsigned int, int64_t)> BufferReadyCallback;
 
 class Encoder
 {
@@ -28,13 +30,24 @@ public:
 	// available. The application may not hang on to the memory once it returns
 	// (but the callback is already running in its own thread).
 	void SetOutputReadyCallback(OutputReadyCallback callback) { output_ready_callback_ = callback; }
+	// Encoders that drop frames under load report each one here, by timestamp, in its place
+	// amongst the output.
+	void SetFrameDroppedCallback(FrameDroppedCallback callback) { frame_dropped_callback_ = callback; }
+	// Encoders that pass their input straight through may instead hand over the input buffer
+	// itself, as both pointer and fd. Whoever takes it gives it back to the application,
+	// rather than the encoder.
+	void SetBufferReadyCallback(BufferReadyCallback callback) { buffer_ready_callback_ = callback; }
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height,
 							  unsigned int stride, int64_t timestamp_us) = 0;
+	// Change the quality setting while encoding; encoders without one ignore this.
+	virtual void SetQuality(int quality) {}
 
 protected:
 	InputDoneCallback input_done_callback_;
 	OutputReadyCallback output_ready_callback_;
+	FrameDroppedCallback frame_dropped_callback_;
+	BufferReadyCallback buffer_ready_callback_;
 	VideoOptions const *options_;
 };
@@ -15,6 +15,8 @@
 #include <chrono>
 #include <iostream>
 
+#include "core/frame_trace.hpp"
+
 #include "h264_encoder.hpp"
 
 static int xioctl(int fd, unsigned long ctl, void *arg)
@@ -221,6 +223,7 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, unsigned int widt
 	buf.m.planes[0].length = size;
 	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
 		throw std::runtime_error("failed to queue input to codec");
+	FrameTrace::Record(timestamp_us, FrameTrace::ENCODE_START);
 }
 
 void H264Encoder::pollThread()
@@ -270,6 +273,7 @@ void H264Encoder::pollThread()
 				// application can take its time with the data without blocking the
 				// encode process.
 				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+				FrameTrace::Record(timestamp_us, FrameTrace::ENCODE_END);
 				OutputItem item = { buffers_[buf.index].mem,
 									buf.m.planes[0].bytesused,
 									buf.m.planes[0].length,
@@ -5,65 +5,223 @@
  * mjpeg_encoder.cpp - mjpeg video encoder.
  */
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
+#include <pthread.h>
+#include <sched.h>
+
 #include <jpeglib.h>
+#include <jerror.h>
+
+#include "core/frame_trace.hpp"
 
 #include "mjpeg_encoder.hpp"
 
-#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
-typedef size_t jpeg_mem_len_t;
-#else
-typedef unsigned long jpeg_mem_len_t;
-#endif
+// The smallest output buffer we allocate, before we have learnt how big frames are.
+static constexpr size_t MIN_BUFFER_SIZE = 65536;
+// Adaptive mode drops a thread after this many frames in a row that needed fewer.
+static constexpr unsigned int SURPLUS_FRAMES = 30;
+
+namespace
+{
+
+// A libjpeg destination that writes into one of our pool's buffers, growing it (much as
+// jpeg_mem_dest would) should it turn out to be too small.
+struct PoolDestination : public jpeg_destination_mgr
+{
+	uint8_t *mem;
+	size_t size;
+	bool overflowed;
+};
+
+void initDestination(j_compress_ptr cinfo)
+{
+	PoolDestination *dest = static_cast<PoolDestination *>(cinfo->dest);
+	dest->next_output_byte = dest->mem;
+	dest->free_in_buffer = dest->size;
+}
+
+boolean emptyOutputBuffer(j_compress_ptr cinfo)
+{
+	PoolDestination *dest = static_cast<PoolDestination *>(cinfo->dest);
+	size_t new_size = dest->size * 2;
+	uint8_t *mem = (uint8_t *)realloc(dest->mem, new_size);
+	if (!mem)
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+	dest->next_output_byte = mem + dest->size;
+	dest->free_in_buffer = new_size - dest->size;
+	dest->mem = mem;
+	dest->size = new_size;
+	dest->overflowed = true;
+	return TRUE;
+}
+
+void termDestination(j_compress_ptr cinfo)
+{
+}
+
+} // namespace
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abort_(false), index_(0)
+	: Encoder(options), abort_(false), index_(0), sequence_(0), quality_(options->quality), frames_waiting_(0),
+	  frames_dropped_(0), max_frame_size_(0), pool_hits_(0), pool_misses_(0), output_sequence_(0), space_waiters_(0)
 {
+	for (auto &slot : reorder_ring_)
+		slot.ready = false;
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
+	unsigned int num_threads = options_->encode_threads;
+	if (num_threads == 0)
+		num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	// Start with all threads active; adaptive mode soon retires any we don't need.
+	active_threads_ = num_threads;
+	item_time_avg_us_ = frame_interval_avg_us_ = 0;
+	last_timestamp_us_ = 0;
+	surplus_frames_ = 0;
+	for (unsigned int i = 0; i < num_threads; i++)
+		encode_threads_.emplace_back(&MjpegEncoder::encodeThread, this, i);
 	if (options_->verbose)
-		std::cerr << "Opened MjpegEncoder" << std::endl;
+		std::cerr << "Opened MjpegEncoder with " << num_threads << (options_->encode_adaptive ? " adaptive" : "")
+				  << " threads" << std::endl;
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
 	abort_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		output_cond_var_.notify_one();
+		space_cond_var_.notify_all();
+	}
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		encode_cond_var_.notify_all();
+	}
+	for (auto &thread : encode_threads_)
+		thread.join();
 	output_thread_.join();
+	for (auto &slot : reorder_ring_)
+	{
+		if (slot.ready)
+			free(slot.item.buffer.mem);
+	}
+	for (auto &buffer : buffer_pool_)
+		free(buffer.mem);
 	if (options_->verbose)
-		std::cerr << "MjpegEncoder closed" << std::endl;
+		std::cerr << "MjpegEncoder closed, " << frames_dropped_ << " frames dropped, output buffer pool hits "
+				  << pool_hits_ << " misses " << pool_misses_ << std::endl;
+}
+
+MjpegEncoder::OutputBuffer MjpegEncoder::getBuffer(size_t min_size)
+{
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex_);
+	size_t needed = std::max(min_size, max_frame_size_);
+	OutputBuffer buffer = { nullptr, 0 };
+	if (!buffer_pool_.empty())
+	{
+		buffer = buffer_pool_.back();
+		buffer_pool_.pop_back();
+		if (buffer.size >= needed)
+		{
+			pool_hits_++;
+			return buffer;
+		}
+	}
+
+	// Leave some headroom so that the frames that are a little bigger still fit.
+	pool_misses_++;
+	size_t size = std::max(needed + needed / 8, MIN_BUFFER_SIZE);
+	uint8_t *mem = (uint8_t *)realloc(buffer.mem, size);
+	if (!mem)
+	{
+		free(buffer.mem);
+		throw std::runtime_error("MjpegEncoder: failed to allocate output buffer");
+	}
+	return { mem, size };
+}
+
+void MjpegEncoder::returnBuffer(OutputBuffer buffer, size_t bytes_used)
+{
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex_);
+	max_frame_size_ = std::max(max_frame_size_, bytes_used);
+	buffer_pool_.push_back(buffer);
 }
 
 void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height,
 								unsigned int stride, int64_t timestamp_us)
 {
-	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, width, height, stride, timestamp_us, index_++ };
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
+	// Strips are made of whole 16-row MCUs, and each must fit in one 16-bit restart interval.
+	unsigned int mcus_per_row = (width + 15) / 16;
+	unsigned int mcu_rows = (height + 15) / 16;
+	unsigned int strip_mcu_rows = (mcu_rows + options_->mjpeg_strips - 1) / options_->mjpeg_strips;
+	if (options_->mjpeg_strips > 1)
+		strip_mcu_rows = std::min(strip_mcu_rows, 65535 / mcus_per_row);
+	unsigned int num_strips = (mcu_rows + strip_mcu_rows - 1) / strip_mcu_rows;
+	auto strips_reading = num_strips > 1 ? std::make_shared<std::atomic<unsigned int>>(num_strips) : nullptr;
+	auto deadline = std::chrono::steady_clock::time_point::max();
+	if (options_->max_frame_age)
+		deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options_->max_frame_age);
+
+	std::vector<EncodeItem> dropped;
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		if (options_->encode_adaptive)
+			adaptThreads(timestamp_us, num_strips);
+		// Make room by dropping the oldest frames that no thread has started on.
+		while (options_->encode_queue_depth && frames_waiting_ >= options_->encode_queue_depth)
+		{
+			auto it = std::find_if(encode_queue_.begin(), encode_queue_.end(),
+								   [](EncodeItem const &item) { return item.strip == 0; });
+			uint64_t index = it->index;
+			for (; it != encode_queue_.end() && it->index == index; it = encode_queue_.erase(it))
+				dropped.push_back(std::move(*it));
+			frames_waiting_--;
+		}
+
+		for (unsigned int strip = 0; strip < num_strips; strip++)
+		{
+			unsigned int first_row = strip * strip_mcu_rows * 16;
+			unsigned int num_rows = std::min(strip_mcu_rows * 16, height - first_row);
+			EncodeItem item = { mem, width, height, stride, timestamp_us, index_, sequence_++, quality_,
+								strip, num_strips, first_row, num_rows, strips_reading, deadline };
+			encode_queue_.push_back(item);
+		}
+		frames_waiting_++;
+		index_++;
+		encode_cond_var_.notify_all();
+	}
+
+	// Publishing may wait for the output to catch up, which needs the encode threads to
+	// finish strips still in the queue, so it mustn't happen while we hold encode_mutex_.
+	for (auto &item : dropped)
+		dropItem(item);
 }
 
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
+void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, OutputBuffer &buffer,
+							  size_t &bytes_used)
 {
 	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
 	cinfo.image_width = item.width;
-	cinfo.image_height = item.height;
+	cinfo.image_height = item.num_rows;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = 0;
 
 	jpeg_set_defaults(&cinfo);
+	// A strip is a single restart interval, so the strips can be joined with restart markers.
+	cinfo.restart_interval = item.num_strips > 1 ? ((item.num_rows + 15) / 16) * ((item.width + 15) / 16) : 0;
 	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, options_->quality, TRUE);
-	encoded_buffer = nullptr;
-	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
-	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
+	jpeg_set_quality(&cinfo, item.quality, TRUE);
+	PoolDestination dest;
+	dest.init_destination = initDestination;
+	dest.empty_output_buffer = emptyOutputBuffer;
+	dest.term_destination = termDestination;
+	dest.mem = buffer.mem;
+	dest.size = buffer.size;
+	dest.overflowed = false;
+	cinfo.dest = &dest;
 	jpeg_start_compress(&cinfo, TRUE);
 
 	int stride2 = item.stride / 2;
@@ -73,12 +231,15 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	uint8_t *Y_max = U - item.stride;
 	uint8_t *U_max = V - stride2;
 	uint8_t *V_max = U_max + stride2 * (item.height / 2);
+	Y += item.stride * item.first_row;
+	U += stride2 * (item.first_row / 2);
+	V += stride2 * (item.first_row / 2);
 
 	JSAMPROW y_rows[16];
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.height;)
+	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.num_rows;)
 	{
 		for (int i = 0; i < 16; i++, Y_row += item.stride)
 			y_rows[i] = std::min(Y_row, Y_max);
@@ -90,11 +251,65 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	}
 
 	jpeg_finish_compress(&cinfo);
-	buffer_len = jpeg_mem_len;
+	cinfo.dest = nullptr;
+	buffer = { dest.mem, dest.size };
+	bytes_used = dest.size - dest.free_in_buffer;
+	if (dest.overflowed)
+		pool_misses_++;
+}
+
+void MjpegEncoder::adaptThreads(int64_t timestamp_us, unsigned int items_per_frame)
+{
+	if (last_timestamp_us_ && timestamp_us > last_timestamp_us_)
+	{
+		double interval = timestamp_us - last_timestamp_us_;
+		frame_interval_avg_us_ = frame_interval_avg_us_ ? 0.9 * frame_interval_avg_us_ + 0.1 * interval : interval;
+	}
+	last_timestamp_us_ = timestamp_us;
+	if (!frame_interval_avg_us_ || !item_time_avg_us_)
+		return;
+
+	unsigned int needed = std::ceil(item_time_avg_us_ * items_per_frame / frame_interval_avg_us_);
+	// A backlog means we've fallen behind, whatever the averages say.
+	if (frames_waiting_ > 1)
+		needed = std::max(needed, active_threads_ + 1);
+	needed = std::clamp<unsigned int>(needed, 1, encode_threads_.size());
+
+	unsigned int active = active_threads_;
+	if (needed > active_threads_)
+	{
+		active_threads_ = needed;
+		encode_cond_var_.notify_all();
+	}
+	else if (needed < active_threads_ && ++surplus_frames_ >= SURPLUS_FRAMES)
+		active_threads_--;
+	if (needed >= active_threads_ || active_threads_ != active)
+		surplus_frames_ = 0;
+
+	if (options_->verbose && active_threads_ != active)
+		std::cerr << "MjpegEncoder: " << active_threads_ << " threads active, item encode time "
+				  << item_time_avg_us_ << " us, frame interval " << frame_interval_avg_us_ << " us" << std::endl;
 }
 
-void MjpegEncoder::encodeThread(int num)
+void MjpegEncoder::encodeThread(unsigned int num)
 {
+	// Adaptive mode's workers each go on a core of their own, in turn, apart from the one
+	// that the app pins request completion to.
+	unsigned int num_cpus = std::thread::hardware_concurrency();
+	int reserved = options_->encode_reserve_cpu < (int)num_cpus ? options_->encode_reserve_cpu : -1;
+	unsigned int usable = num_cpus - (reserved >= 0);
+	if (options_->encode_adaptive && usable > 0)
+	{
+		unsigned int cpu = num % usable;
+		if (reserved >= 0 && cpu >= (unsigned int)reserved)
+			cpu++;
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) && options_->verbose)
+			std::cerr << "MjpegEncoder: failed to set affinity of thread " << num << std::endl;
+	}
+
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	cinfo.err = jpeg_std_error(&jerr);
@@ -103,11 +318,16 @@ void MjpegEncoder::encodeThread(int num)
 	uint32_t frames = 0;
 
 	EncodeItem encode_item;
+	double item_time_us = 0;
+	std::vector<EncodeItem> dropped;
 	while (true)
 	{
 		{
 			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
+			if (item_time_us)
+				item_time_avg_us_ = item_time_avg_us_ ? 0.9 * item_time_avg_us_ + 0.1 * item_time_us : item_time_us;
+			item_time_us = 0;
+			while (dropped.empty())
 			{
 				using namespace std::chrono_literals;
 				if (abort_)
@@ -118,69 +338,213 @@ void MjpegEncoder::encodeThread(int num)
 					jpeg_destroy_compress(&cinfo);
 					return;
 				}
-				if (!encode_queue_.empty())
+				if (num < active_threads_ && !encode_queue_.empty())
 				{
 					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
+					encode_queue_.pop_front();
+					if (encode_item.strip != 0)
+						break;
+					frames_waiting_--;
+					// A frame that has waited too long is dropped, strips and all, instead of
+					// being started. Those behind it are checked in turn, oldest first.
+					if (std::chrono::steady_clock::now() <= encode_item.deadline)
+						break;
+					dropped.push_back(encode_item);
+					for (; !encode_queue_.empty() && encode_queue_.front().index == encode_item.index;
+						 encode_queue_.pop_front())
+						dropped.push_back(std::move(encode_queue_.front()));
 				}
 				else
 					encode_cond_var_.wait_for(lock, 200ms);
 			}
 		}
 
+		// As in EncodeBuffer, drops are published without the lock, before we look again.
+		if (!dropped.empty())
+		{
+			for (auto &item : dropped)
+				dropItem(item);
+			dropped.clear();
+			continue;
+		}
+
 		// Encode the buffer.
-		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
+		OutputBuffer buffer = getBuffer(0);
+		size_t bytes_used = 0;
 		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
-		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
+		FrameTrace::Record(encode_item.timestamp_us, FrameTrace::ENCODE_START);
+		encodeJPEG(cinfo, encode_item, buffer, bytes_used);
+		FrameTrace::Record(encode_item.timestamp_us, FrameTrace::ENCODE_END);
+		std::chrono::duration<double, std::micro> item_time = std::chrono::high_resolution_clock::now() - start_time;
+		item_time_us = item_time.count();
+		encode_time += item_time;
 		frames++;
-		// Don't return buffers until the output thread as that's where they're
-		// in order again.
+		// We have finished reading the input, so it can go straight back to the camera,
+		// however long the output takes. Only the outputs need to be in order.
+		if (!encode_item.strips_reading || --*encode_item.strips_reading == 0)
+			input_done_callback_(encode_item.mem);
+		encode_item.strips_reading.reset();
 
 		// We push this encoded buffer to another thread so that our
 		// application can take its time with the data without blocking the
 		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
+		publishItem(encode_item.sequence,
+					{ buffer, bytes_used, encode_item.timestamp_us, encode_item.strip, encode_item.num_strips });
+	}
+}
+
+void MjpegEncoder::dropItem(EncodeItem &item)
+{
+	if (!item.strips_reading || --*item.strips_reading == 0)
+		input_done_callback_(item.mem);
+	item.strips_reading.reset();
+	publishItem(item.sequence, { { nullptr, 0 }, 0, item.timestamp_us, item.strip, item.num_strips });
+}
+
+void MjpegEncoder::publishItem(uint64_t sequence, OutputItem const &item)
+{
+	// Only wait in the rare case that this item is a whole ring ahead of the output.
+	if (sequence - output_sequence_ >= REORDER_SLOTS)
+	{
+		std::unique_lock<std::mutex> lock(output_mutex_);
+		space_waiters_++;
+		space_cond_var_.wait(lock, [this, sequence] {
+			return abort_ || sequence - output_sequence_ < REORDER_SLOTS;
+		});
+		space_waiters_--;
+		if (abort_)
+		{
+			free(item.buffer.mem);
+			return;
+		}
+	}
+
+	ReorderSlot &slot = reorder_ring_[sequence % REORDER_SLOTS];
+	slot.item = item;
+	slot.ready = true;
+	// The output thread sets output_sequence_ before it looks at the slot, so if this isn't
+	// the item it wants yet, it will find this one ready when it gets here.
+	if (sequence == output_sequence_)
+	{
 		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
 		output_cond_var_.notify_one();
 	}
 }
 
+// Returns the offset of the entropy-coded data, just after the SOS header, and optionally
+// where the frame height is in the SOF header.
+static size_t scanStart(uint8_t const *jpeg, size_t len, size_t *height_offset = nullptr)
+{
+	for (size_t pos = 2; pos + 4 <= len;)
+	{
+		if (jpeg[pos] != 0xff)
+			break;
+		uint8_t marker = jpeg[pos + 1];
+		size_t segment_len = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+		if (marker >= 0xc0 && marker <= 0xc2 && height_offset)
+			*height_offset = pos + 5;
+		pos += 2 + segment_len;
+		if (marker == 0xda)
+			return pos;
+	}
+	throw std::runtime_error("MjpegEncoder: malformed JPEG strip");
+}
+
+MjpegEncoder::OutputItem MjpegEncoder::stitchStrips(std::vector<OutputItem> &strips)
+{
+	// The first strip supplies the headers, with the height patched to the whole frame.
+	// Then comes the data of every strip, each but the last ending in the next restart
+	// marker instead of EOI.
+	uint8_t const *first = strips[0].buffer.mem;
+	size_t height_offset = 0;
+	size_t header_len = scanStart(first, strips[0].bytes_used, &height_offset);
+	std::vector<size_t> starts;
+	size_t total = header_len;
+	unsigned int height = 0;
+	for (auto const &strip : strips)
+	{
+		uint8_t const *jpeg = strip.buffer.mem;
+		size_t offset = 0;
+		starts.push_back(scanStart(jpeg, strip.bytes_used, &offset));
+		height += (jpeg[offset] << 8) | jpeg[offset + 1];
+		total += strip.bytes_used - starts.back();
+	}
+
+	OutputBuffer buffer = getBuffer(total);
+	uint8_t *output = buffer.mem;
+	memcpy(output, first, header_len);
+	output[height_offset] = height >> 8;
+	output[height_offset + 1] = height & 0xff;
+	uint8_t *ptr = output + header_len;
+	for (unsigned int i = 0; i < strips.size(); i++)
+	{
+		size_t data_len = strips[i].bytes_used - starts[i] - 2;
+		memcpy(ptr, strips[i].buffer.mem + starts[i], data_len);
+		ptr += data_len;
+		*ptr++ = 0xff;
+		*ptr++ = i + 1 < strips.size() ? 0xd0 + (i & 7) : 0xd9;
+		returnBuffer(strips[i].buffer, strips[i].bytes_used);
+	}
+
+	return { buffer, total, strips[0].timestamp_us, 0, 1 };
+}
+
 void MjpegEncoder::outputThread()
 {
 	OutputItem item;
-	uint64_t index = 0;
-	while (true)
+	std::vector<OutputItem> strips;
+	for (uint64_t sequence = 0;; sequence++)
 	{
+		ReorderSlot &slot = reorder_ring_[sequence % REORDER_SLOTS];
 		{
 			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
+			output_cond_var_.wait(lock, [this, &slot] { return abort_ || slot.ready; });
+			if (abort_)
 			{
-				using namespace std::chrono_literals;
-				if (abort_)
-					return;
-				// We look for the thread that's completed the frame we want next.
-				// If we don't find it, we wait.
-				for (auto &q : output_queue_)
+				for (auto &s : strips)
+					free(s.buffer.mem);
+				return;
+			}
+		}
+		item = slot.item;
+		slot.ready = false;
+		output_sequence_ = sequence + 1;
+		if (space_waiters_)
+		{
+			std::lock_guard<std::mutex> lock(output_mutex_);
+			space_cond_var_.notify_all();
+		}
+
+		if (item.num_strips > 1)
+		{
+			strips.push_back(item);
+			if (strips.size() < item.num_strips)
+				continue;
+			// A frame missing any strip is dropped altogether.
+			if (std::all_of(strips.begin(), strips.end(), [](OutputItem const &s) { return s.buffer.mem; }))
+				item = stitchStrips(strips);
+			else
+			{
+				for (auto &s : strips)
 				{
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
+					if (s.buffer.mem)
+						returnBuffer(s.buffer, s.bytes_used);
 				}
-				output_cond_var_.wait_for(lock, 200ms);
+				item.buffer = { nullptr, 0 };
 			}
+			strips.clear();
 		}
-	got_item:
-		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
-		index++;
+		if (item.buffer.mem)
+		{
+			output_ready_callback_(item.buffer.mem, item.bytes_used, item.timestamp_us, true);
+			returnBuffer(item.buffer, item.bytes_used);
+		}
+		else
+		{
+			frames_dropped_++;
+			if (frame_dropped_callback_)
+				frame_dropped_callback_(item.timestamp_us);
+		}
 	}
 }
@@ -7,10 +7,14 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
@@ -24,21 +28,40 @@ public:
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height, unsigned int stride,
 					  int64_t timestamp_us) override;
+	// Takes effect from the next frame to start encoding.
+	void SetQuality(int quality) override { quality_ = quality; }
+	// How often an encoded frame found a big enough buffer waiting in the pool, and how often
+	// one had to be allocated or grown.
+	uint64_t PoolHits() const { return pool_hits_; }
+	uint64_t PoolMisses() const { return pool_misses_; }
+	// Frames dropped, rather than encoded, because the encoder fell behind.
+	uint64_t FramesDropped() const { return frames_dropped_; }
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 6;
+	// These threads do the actual encoding. Whichever active thread is idle will pick up the
+	// next frame.
+	void encodeThread(unsigned int num);
 
-	// These threads do the actual encoding.
-	void encodeThread(int num);
+	// In adaptive mode, threads numbered active_threads_ and up sit idle. How many are needed
+	// is worked out from averages of the time to encode an item and the time between frames,
+	// and from how many frames are waiting. We add threads as soon as they're needed, but only
+	// take them away one at a time once there have been too many for a while.
+	void adaptThreads(int64_t timestamp_us, unsigned int items_per_frame);
+	unsigned int active_threads_;
+	double item_time_avg_us_;
+	double frame_interval_avg_us_;
+	int64_t last_timestamp_us_;
+	unsigned int surplus_frames_;
 
 	// Handle the output buffers in another thread so as not to block the encoders. The
 	// application can take its time, after which we return this buffer to the encoder for
 	// re-use.
 	void outputThread();
 
-	bool abort_;
+	std::atomic<bool> abort_;
 	uint64_t index_;
+	uint64_t sequence_;
+	std::atomic<int> quality_;
 
 	struct EncodeItem
 	{
@@ -48,22 +71,72 @@ private:
 		unsigned int stride;
 		int64_t timestamp_us;
 		uint64_t index;
+		uint64_t sequence; // of the output, counting every strip
+		int quality;
+		// Frames may be split into strips that are encoded separately, each covering rows
+		// first_row to first_row + num_rows - 1. All the strips share a count of how many are
+		// still reading the frame.
+		unsigned int strip;
+		unsigned int num_strips;
+		unsigned int first_row;
+		unsigned int num_rows;
+		std::shared_ptr<std::atomic<unsigned int>> strips_reading;
+		// Frames not started by this time are dropped.
+		std::chrono::steady_clock::time_point deadline;
 	};
-	std::queue<EncodeItem> encode_queue_;
+	std::deque<EncodeItem> encode_queue_;
+	unsigned int frames_waiting_; // frames with no strip started yet
+	std::atomic<uint64_t> frames_dropped_;
+	// Give up on the item, sending the output thread an empty one in its place.
+	void dropItem(EncodeItem &item);
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::vector<std::thread> encode_threads_;
+
+	// Frames are encoded into buffers from a pool, rather than libjpeg allocating a new one
+	// every time. New buffers are sized from the largest frame seen so far, and they go back
+	// in the pool once output.
+	struct OutputBuffer
+	{
+		uint8_t *mem;
+		size_t size;
+	};
+	OutputBuffer getBuffer(size_t min_size);
+	void returnBuffer(OutputBuffer buffer, size_t bytes_used);
+	std::vector<OutputBuffer> buffer_pool_;
+	std::mutex buffer_pool_mutex_;
+	size_t max_frame_size_;
+	std::atomic<uint64_t> pool_hits_;
+	std::atomic<uint64_t> pool_misses_;
+
+	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, OutputBuffer &buffer, size_t &bytes_used);
 
 	struct OutputItem
 	{
-		void *mem;
+		OutputBuffer buffer;
 		size_t bytes_used;
 		int64_t timestamp_us;
-		uint64_t index;
+		unsigned int strip;
+		unsigned int num_strips;
+	};
+	// Join the strips of a frame back into a single JPEG, returning the strips to the pool.
+	OutputItem stitchStrips(std::vector<OutputItem> &strips);
+	// Encoded items are put back in order in a ring, where each goes in the slot for its
+	// sequence number. Publishing one needs no lock, and the output thread is woken only
+	// when the item it is waiting for arrives. Should an item get a whole ring ahead of the
+	// output, its encode thread waits for space.
+	static const unsigned int REORDER_SLOTS = 64;
+	struct ReorderSlot
+	{
+		std::atomic<bool> ready;
+		OutputItem item;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
+	void publishItem(uint64_t sequence, OutputItem const &item);
+	ReorderSlot reorder_ring_[REORDER_SLOTS];
+	std::atomic<uint64_t> output_sequence_; // the next item to output
+	std::atomic<unsigned int> space_waiters_;
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
+	std::condition_variable space_cond_var_;
 	std::thread output_thread_;
 };
@@ -31,7 +31,7 @@ void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, unsigned int widt
 							   unsigned int stride, int64_t timestamp_us)
 {
 	std::lock_guard<std::mutex> lock(output_mutex_);
-	OutputItem item = { mem, size, timestamp_us };
+	OutputItem item = { mem, fd, size, width, height, stride, timestamp_us };
 	output_queue_.push(item);
 	output_cond_var_.notify_one();
 }
@@ -60,6 +60,12 @@ void NullEncoder::outputThread()
 					return;
 			}
 		}
+		if (buffer_ready_callback_)
+		{
+			buffer_ready_callback_(item.mem, item.fd, item.length, item.width, item.height, item.stride,
+								   item.timestamp_us);
+			continue;
+		}
 		output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
 		input_done_callback_(nullptr);
 	}
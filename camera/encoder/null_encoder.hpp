@@ -31,7 +31,11 @@ private:
 	struct OutputItem
 	{
 		void *mem;
+		int fd;
 		size_t length;
+		unsigned int width;
+		unsigned int height;
+		unsigned int stride;
 		int64_t timestamp_us;
 	};
 	std::queue<OutputItem> output_queue_;
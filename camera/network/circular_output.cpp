@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * circular_output.cpp - hold recent frames in memory until something happens.
+ */
+
+#include <cstring>
+#include <iostream>
+
+#include "circular_output.hpp"
+
+CircularOutput::CircularOutput(VideoOptions const *options, std::unique_ptr<Output> sink)
+	: Output(options), sink_(std::move(sink)), triggered_(false), live_(false), live_until_us_(0),
+	  sink_started_(false)
+{
+	// Touch the whole arena now, rather than taking page faults while we record.
+	arena_.resize(static_cast<size_t>(options_->circular) << 20);
+}
+
+CircularOutput::~CircularOutput()
+{
+	try
+	{
+		flush();
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: failed to write out circular buffer: " << e.what() << std::endl;
+	}
+}
+
+void CircularOutput::Trigger()
+{
+	triggered_ = true;
+}
+
+bool CircularOutput::allocate(size_t size, size_t &offset)
+{
+	// Too big ever to fit, so it's skipped, and the history we have is left alone.
+	if (size > arena_.size())
+		return false;
+	while (!entries_.empty())
+	{
+		Entry const &front = entries_.front(), &back = entries_.back();
+		size_t end = back.offset + back.size;
+		if (back.offset >= front.offset)
+		{
+			// Data runs from front to back; try after it, then before it.
+			if (arena_.size() - end >= size)
+			{
+				offset = end;
+				return true;
+			}
+			if (front.offset >= size)
+			{
+				offset = 0;
+				return true;
+			}
+		}
+		else if (front.offset - end >= size)
+		{
+			offset = end;
+			return true;
+		}
+		entries_.pop_front();
+	}
+	offset = 0;
+	return true;
+}
+
+void CircularOutput::write(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// Every run of frames we hand on must begin at a keyframe.
+	if (!sink_started_)
+	{
+		if (!(flags & FLAG_KEYFRAME))
+			return;
+		flags |= FLAG_RESTART;
+		sink_started_ = true;
+	}
+	sink_->outputBuffer(mem, size, timestamp_us, flags);
+}
+
+void CircularOutput::flush()
+{
+	if (options_->verbose && !entries_.empty())
+		std::cerr << "CircularOutput: writing out " << entries_.size() << " frames" << std::endl;
+	while (!entries_.empty())
+	{
+		Entry entry = entries_.front();
+		entries_.pop_front();
+		write(&arena_[entry.offset], entry.size, entry.timestamp_us, entry.flags);
+	}
+}
+
+void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	if (triggered_.exchange(false))
+	{
+		flush();
+		live_ = true;
+		live_until_us_ = timestamp_us + options_->circular_post * 1000LL;
+	}
+
+	if (live_)
+	{
+		if (timestamp_us <= live_until_us_)
+		{
+			write(mem, size, timestamp_us, flags);
+			return;
+		}
+		if (options_->verbose)
+			std::cerr << "CircularOutput: buffering" << std::endl;
+		live_ = false;
+		sink_started_ = false;
+	}
+
+	size_t offset;
+	if (size == 0 || !allocate(size, offset))
+	{
+		if (options_->verbose && size)
+			std::cerr << "CircularOutput: " << size << " byte frame does not fit in the buffer" << std::endl;
+		return;
+	}
+	memcpy(&arena_[offset], mem, size);
+	entries_.push_back({ offset, size, timestamp_us, flags });
+
+	if (options_->circular_seconds)
+	{
+		int64_t oldest_us = timestamp_us - options_->circular_seconds * 1000000LL;
+		while (!entries_.empty() && entries_.front().timestamp_us < oldest_us)
+			entries_.pop_front();
+	}
+}
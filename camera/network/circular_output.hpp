@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * circular_output.hpp - hold recent frames in memory until something happens.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "output.hpp"
+
+// Keeps the most recent --circular MB (and at most --circular-seconds) of encoded frames
+// in a single arena allocated up front, and passes nothing on to the real output until
+// triggered. A trigger writes out the history, from its oldest keyframe, and then passes
+// frames straight through for --circular-post ms after the latest trigger, when we go back
+// to buffering. Whatever is held when we finish is written out too.
+class CircularOutput : public Output
+{
+public:
+	CircularOutput(VideoOptions const *options, std::unique_ptr<Output> sink);
+	~CircularOutput();
+	// May be called from any thread; the history is written out with the next frame.
+	void Trigger() override;
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	struct Entry
+	{
+		size_t offset;
+		size_t size;
+		int64_t timestamp_us;
+		uint32_t flags;
+	};
+
+	// Find room for a frame, dropping the oldest ones until it fits. Frames are never
+	// split across the end of the arena.
+	bool allocate(size_t size, size_t &offset);
+	void flush();
+	void write(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+
+	std::unique_ptr<Output> sink_;
+	std::vector<uint8_t> arena_;
+	std::deque<Entry> entries_;
+	std::atomic<bool> triggered_;
+	bool live_;
+	int64_t live_until_us_;
+	bool sink_started_; // whether the sink has had a keyframe since we last went back to buffering
+};
@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * dmabuf_output.cpp - lend camera buffers to another process.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "core/frame_trace.hpp"
+
+#include "dmabuf_output.hpp"
+
+DmabufOutput::DmabufOutput(VideoOptions const *options)
+	: Output(options), connected_(true), sequence_(0), frames_skipped_(0)
+{
+	std::string path = options->output.substr(9);
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("dmabuf socket path too long: " + path);
+	strcpy(addr.sun_path, path.c_str());
+
+	fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("unable to open unix socket");
+	if (connect(fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(fd_);
+		throw std::runtime_error("unable to connect to unix socket " + path);
+	}
+
+	ack_thread_ = std::thread(&DmabufOutput::ackThread, this);
+}
+
+DmabufOutput::~DmabufOutput()
+{
+	// Wakes the ack thread, which gives back everything still lent out.
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		connected_ = false;
+	}
+	shutdown(fd_, SHUT_RDWR);
+	ack_thread_.join();
+	close(fd_);
+	if (options_->verbose)
+		std::cerr << "DmabufOutput: lent " << sequence_ << " frames, skipped " << frames_skipped_ << std::endl;
+}
+
+void DmabufOutput::release(void *mem)
+{
+	try
+	{
+		buffer_done_callback_(mem);
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: DmabufOutput: " << e.what() << std::endl;
+	}
+}
+
+void DmabufOutput::BufferReady(void *mem, int fd, size_t size, unsigned int width, unsigned int height,
+							   unsigned int stride, int64_t timestamp_us)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (!connected_ || held_.size() >= MAX_HELD)
+	{
+		frames_skipped_++;
+		lock.unlock();
+		release(mem);
+		return;
+	}
+
+	DmabufFrame frame = {};
+	memcpy(frame.magic, "CRDB", 4);
+	frame.version = VERSION;
+	frame.sequence = sequence_;
+	frame.timestamp_us = timestamp_us;
+	frame.size = size;
+	frame.width = width;
+	frame.height = height;
+	frame.stride = stride;
+
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int))];
+		cmsghdr align;
+	} control = {};
+	iovec iov = { &frame, sizeof(frame) };
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	FrameTrace::Record(timestamp_us, FrameTrace::OUTPUT_START);
+	if (sendmsg(fd_, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+	{
+		// A full socket means the consumer isn't keeping up, so this frame is skipped. The
+		// ack thread finds out for itself if the consumer has gone.
+		if (options_->verbose && errno != EAGAIN)
+			std::cerr << "DmabufOutput: failed to send frame: " << strerror(errno) << std::endl;
+		frames_skipped_++;
+		lock.unlock();
+		release(mem);
+		return;
+	}
+	held_[sequence_++] = { mem, timestamp_us };
+}
+
+void DmabufOutput::ackThread()
+{
+	while (true)
+	{
+		DmabufAck ack;
+		ssize_t ret = recv(fd_, &ack, sizeof(ack), 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		std::vector<std::pair<void *, int64_t>> done;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (ret == sizeof(ack))
+			{
+				auto it = held_.find(ack.sequence);
+				if (it != held_.end())
+				{
+					done.push_back(it->second);
+					held_.erase(it);
+				}
+				else if (options_->verbose)
+					std::cerr << "DmabufOutput: ack for unknown frame " << ack.sequence << std::endl;
+			}
+			else
+			{
+				// The consumer went away (or we're closing), so take everything back.
+				if (options_->verbose && connected_)
+					std::cerr << "DmabufOutput: consumer disconnected" << std::endl;
+				connected_ = false;
+				for (auto &held : held_)
+					done.push_back(held.second);
+				held_.clear();
+			}
+		}
+
+		for (auto &buffer : done)
+		{
+			release(buffer.first);
+			FrameTrace::Record(buffer.second, FrameTrace::OUTPUT_END);
+		}
+		if (ret != sizeof(ack))
+			return;
+	}
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * dmabuf_output.hpp - lend camera buffers to another process.
+ */
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "output.hpp"
+
+// A dmabuf:///path/to/socket output (only with --codec yuv420) connects to a consumer
+// listening on a SOCK_SEQPACKET unix socket, and sends it a DmabufFrame for each frame, with
+// the camera buffer's dmabuf fd attached as SCM_RIGHTS. The three planes follow each other
+// in the one buffer: Y at 0, U at stride * height and V a quarter of that further on, with
+// half the stride. The consumer maps the fd (or recognises it from earlier, by inode), uses
+// the frame, closes the fd and sends back a DmabufAck with the frame's sequence number,
+// which is when the buffer goes back to the camera. We lend at most MAX_HELD buffers at
+// once, and skip frames beyond that, so a slow consumer can't starve the camera.
+struct DmabufFrame
+{
+	char magic[4]; // "CRDB"
+	uint32_t version;
+	uint64_t sequence;
+	int64_t timestamp_us;
+	uint32_t size;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride; // of the Y plane
+};
+
+struct DmabufAck
+{
+	uint64_t sequence;
+};
+
+class DmabufOutput : public Output
+{
+public:
+	static constexpr uint32_t VERSION = 1;
+	static constexpr unsigned int MAX_HELD = 3;
+
+	DmabufOutput(VideoOptions const *options);
+	~DmabufOutput();
+
+	bool TakesBuffers() const override { return true; }
+	void BufferReady(void *mem, int fd, size_t size, unsigned int width, unsigned int height, unsigned int stride,
+					 int64_t timestamp_us) override;
+
+private:
+	void ackThread();
+	void release(void *mem);
+
+	int fd_;
+	bool connected_;
+	uint64_t sequence_;
+	std::map<uint64_t, std::pair<void *, int64_t>> held_; // buffer and timestamp, by sequence
+	std::mutex mutex_;
+	std::thread ack_thread_;
+	unsigned int frames_skipped_;
+};
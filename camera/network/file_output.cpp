@@ -0,0 +1,209 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * file_output.cpp - write output to files.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include "file_output.hpp"
+
+FileOutput::FileOutput(VideoOptions const *options)
+	: Output(options), count_(0), file_open_(false), file_start_time_ms_(0), file_frames_(0), block_(nullptr),
+	  block_used_(0), abort_(false)
+{
+	if (options_->sync == "segment")
+		sync_ = SYNC_SEGMENT;
+	else if (options_->sync == "frame")
+		sync_ = SYNC_FRAME;
+	else
+		sync_ = SYNC_NONE;
+
+	// Aligned to the page size, so the kernel can take whole pages from us.
+	for (unsigned int i = 0; i < NUM_BLOCKS; i++)
+	{
+		void *mem;
+		if (posix_memalign(&mem, 4096, BLOCK_SIZE))
+		{
+			for (uint8_t *block : free_blocks_)
+				free(block);
+			throw std::runtime_error("FileOutput: failed to allocate write buffers");
+		}
+		free_blocks_.push_back((uint8_t *)mem);
+	}
+	block_ = free_blocks_.back();
+	free_blocks_.pop_back();
+
+	io_thread_ = std::thread(&FileOutput::ioThread, this);
+}
+
+FileOutput::~FileOutput()
+{
+	closeFile();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		job_cond_var_.notify_one();
+	}
+	io_thread_.join();
+
+	free(block_);
+	for (uint8_t *block : free_blocks_)
+		free(block);
+}
+
+void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// Each error is thrown once, so that output can carry on if the trouble passes (a disk
+	// that was briefly full, say, or a new segment's file that opens fine).
+	std::string error;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		error.swap(error_);
+	}
+	if (!error.empty())
+		throw std::runtime_error(error);
+
+	// Start a new file when the segment is full, though we have to wait for a keyframe, or
+	// when recording restarts in "split" mode (which is necessarily a keyframe already).
+	bool segment_full = (options_->segment && timestamp_us / 1000 - file_start_time_ms_ >= options_->segment) ||
+						(options_->segment_frames && file_frames_ >= options_->segment_frames);
+	if (!file_open_ || ((flags & FLAG_KEYFRAME) && segment_full) || (options_->split && (flags & FLAG_RESTART)))
+	{
+		closeFile();
+		openFile(timestamp_us);
+	}
+
+	for (uint8_t *data = (uint8_t *)mem; size;)
+	{
+		size_t n = std::min(size, BLOCK_SIZE - block_used_);
+		memcpy(block_ + block_used_, data, n);
+		block_used_ += n;
+		data += n;
+		size -= n;
+		if (block_used_ == BLOCK_SIZE)
+			flushBlock();
+	}
+	file_frames_++;
+
+	if (sync_ == SYNC_FRAME)
+		flushBlock();
+}
+
+void FileOutput::openFile(int64_t timestamp_us)
+{
+	char filename[256];
+	int n = snprintf(filename, sizeof(filename), options_->output.c_str(), count_++);
+	if (n < 0 || n >= (int)sizeof(filename))
+		throw std::runtime_error("FileOutput: output file name too long");
+	if (options_->verbose)
+		std::cerr << "FileOutput: opening " << filename << std::endl;
+
+	submit({ Job::OPEN, filename, nullptr, 0 });
+	file_open_ = true;
+	file_start_time_ms_ = timestamp_us / 1000;
+	file_frames_ = 0;
+}
+
+void FileOutput::closeFile()
+{
+	if (!file_open_)
+		return;
+	if (block_used_)
+		flushBlock();
+	submit({ Job::CLOSE, "", nullptr, 0 });
+	file_open_ = false;
+}
+
+void FileOutput::flushBlock()
+{
+	submit({ Job::WRITE, "", block_, block_used_ });
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	free_cond_var_.wait(lock, [this] { return !free_blocks_.empty(); });
+	block_ = free_blocks_.back();
+	free_blocks_.pop_back();
+	block_used_ = 0;
+}
+
+void FileOutput::submit(Job const &job)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	jobs_.push(job);
+	job_cond_var_.notify_one();
+}
+
+void FileOutput::ioThread()
+{
+	int fd = -1;
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			job_cond_var_.wait(lock, [this] { return abort_ || !jobs_.empty(); });
+			// Only quit once everything has been written.
+			if (jobs_.empty())
+				break;
+			job = jobs_.front();
+			jobs_.pop();
+		}
+
+		std::string error;
+		if (job.type == Job::OPEN)
+		{
+			fd = open(job.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0)
+				error = "failed to open " + job.filename + ": " + strerror(errno);
+			// Reserve the space up front, so the file isn't fragmented as it grows. Keep the
+			// size as it is, so that the file only ever holds what we've written.
+			else if (options_->preallocate &&
+					 fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)options_->preallocate << 20) < 0 &&
+					 options_->verbose)
+				std::cerr << "FileOutput: unable to preallocate " << job.filename << std::endl;
+		}
+		else if (job.type == Job::WRITE)
+		{
+			for (size_t done = 0; fd >= 0 && done < job.bytes && error.empty();)
+			{
+				ssize_t n = write(fd, job.block + done, job.bytes - done);
+				if (n >= 0)
+					done += n;
+				else if (errno != EINTR)
+					error = std::string("write failed: ") + strerror(errno);
+			}
+			if (fd >= 0 && sync_ == SYNC_FRAME)
+				fdatasync(fd);
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			free_blocks_.push_back(job.block);
+			free_cond_var_.notify_one();
+		}
+		else if (job.type == Job::CLOSE && fd >= 0)
+		{
+			// Give back any of the preallocated space that we didn't use.
+			if (options_->preallocate && ftruncate(fd, lseek(fd, 0, SEEK_CUR)) < 0 && options_->verbose)
+				std::cerr << "FileOutput: unable to trim " << job.filename << std::endl;
+			if (sync_ != SYNC_NONE)
+				fdatasync(fd);
+			close(fd);
+			fd = -1;
+		}
+
+		if (!error.empty())
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (error_.empty())
+				error_ = "FileOutput: " + error;
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+}
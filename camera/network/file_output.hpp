@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * file_output.hpp - write output to files.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// Records to files, starting a new one every --segment ms or --segment-frames frames (at the
+// next keyframe), or whenever recording restarts with --split. File names are made from the
+// output name with the file number in place of any printf directive. Frames are gathered
+// into large, aligned blocks which a separate thread writes out, so that the encoder never
+// waits on the disk unless it gets a whole pool of blocks ahead.
+class FileOutput : public Output
+{
+public:
+	FileOutput(VideoOptions const *options);
+	~FileOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	static constexpr size_t BLOCK_SIZE = 4 << 20;
+	static constexpr unsigned int NUM_BLOCKS = 4;
+
+	// When to wait for data to reach the disk: never, as each file is closed, or after
+	// every frame.
+	enum Sync
+	{
+		SYNC_NONE,
+		SYNC_SEGMENT,
+		SYNC_FRAME
+	} sync_;
+
+	struct Job
+	{
+		enum Type
+		{
+			OPEN,
+			WRITE,
+			CLOSE
+		} type;
+		std::string filename; // for OPEN
+		uint8_t *block; // for WRITE
+		size_t bytes;
+	};
+
+	void openFile(int64_t timestamp_us);
+	void closeFile();
+	// Send the block being filled to the I/O thread, waiting for another to fill.
+	void flushBlock();
+	void submit(Job const &job);
+	void ioThread();
+
+	unsigned int count_;
+	bool file_open_;
+	int64_t file_start_time_ms_;
+	unsigned int file_frames_;
+
+	uint8_t *block_;
+	size_t block_used_;
+	std::vector<uint8_t *> free_blocks_;
+	std::queue<Job> jobs_;
+	bool abort_;
+	std::string error_; // the I/O thread's first error since we last threw one
+	std::mutex mutex_;
+	std::condition_variable job_cond_var_;
+	std::condition_variable free_cond_var_;
+	std::thread io_thread_;
+};
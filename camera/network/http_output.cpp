@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * http_output.cpp - serve MJPEG to browsers.
+ */
+
+#include <cstring>
+#include <iostream>
+
+#include "http_output.hpp"
+
+static const std::string BOUNDARY = "frame";
+
+static std::shared_ptr<std::vector<uint8_t>> make_response(std::string const &text)
+{
+	return std::make_shared<std::vector<uint8_t>>(text.begin(), text.end());
+}
+
+HttpOutput::HttpOutput(VideoOptions const *options) : TcpServerOutput(options)
+{
+}
+
+HttpOutput::~HttpOutput()
+{
+	stop();
+}
+
+TcpServerOutput::Frame HttpOutput::makeFrame(void *mem, size_t size)
+{
+	char header[128];
+	int header_length = snprintf(header, sizeof(header),
+								 "--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %lu\r\n\r\n", BOUNDARY.c_str(),
+								 static_cast<unsigned long>(size));
+	Frame frame = std::make_shared<std::vector<uint8_t>>(header_length + size + 2);
+	uint8_t *p = frame->data();
+	memcpy(p, header, header_length);
+	memcpy(p + header_length, mem, size);
+	memcpy(p + header_length + size, "\r\n", 2);
+	return frame;
+}
+
+bool HttpOutput::clientInput(Client &client, char const *data, size_t size)
+{
+	// Anything after the request (there shouldn't be) we ignore.
+	if (client.streaming || client.closing)
+		return true;
+	client.request.append(data, size);
+	size_t end = client.request.find("\r\n\r\n");
+	if (end == std::string::npos)
+		return true;
+
+	std::string line = client.request.substr(0, client.request.find("\r\n"));
+	char method[16], target[1024];
+	if (sscanf(line.c_str(), "%15s %1023s", method, target) != 2 || strcmp(method, "GET"))
+	{
+		client.queue.push_back(make_response("HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\n"
+											 "Content-Length: 0\r\nConnection: close\r\n\r\n"));
+		client.closing = true;
+		return true;
+	}
+
+	unsigned int fps = options_->http_fps;
+	char const *query = strchr(target, '?');
+	if (query)
+	{
+		char const *param = strstr(query, "fps=");
+		if (param && (param == query + 1 || param[-1] == '&'))
+			fps = atoi(param + 4);
+	}
+	client.min_interval_us = fps ? 1000000 / fps : 0;
+
+	client.queue.push_back(make_response("HTTP/1.0 200 OK\r\n"
+										 "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+										 "Pragma: no-cache\r\n"
+										 "Access-Control-Allow-Origin: *\r\n"
+										 "Connection: close\r\n"
+										 "Content-Type: multipart/x-mixed-replace; boundary=" +
+										 BOUNDARY + "\r\n\r\n"));
+	client.streaming = true;
+	if (options_->verbose)
+		std::cerr << "HttpOutput: client " << client.name << " wants " << target << std::endl;
+	return true;
+}
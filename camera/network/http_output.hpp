@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * http_output.hpp - serve MJPEG to browsers.
+ */
+
+#pragma once
+
+#include "tcp_server_output.hpp"
+
+// An http://a.b.c.d:port output (mjpeg only) answers a GET for any path with an endless
+// multipart/x-mixed-replace response, one JPEG per part, which browsers show as live video.
+// A client can cap its own frame rate with "?fps=N", and otherwise gets --http-fps (where
+// 0 means every frame). Everything else, from sharing frames between clients to skipping
+// them for slow ones, works as for the tcp server.
+class HttpOutput : public TcpServerOutput
+{
+public:
+	HttpOutput(VideoOptions const *options);
+	~HttpOutput();
+
+protected:
+	Frame makeFrame(void *mem, size_t size) override;
+	void clientConnected(Client &client) override {}
+	bool clientInput(Client &client, char const *data, size_t size) override;
+};
@@ -11,8 +11,11 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <iostream>
 
+#include <libcamera/control_ids.h>
+
 #include <nlohmann/json.hpp>
 #include "net_input.hpp"
 
@@ -21,7 +24,7 @@
 
 using json = nlohmann::json;
 
-NetInput::NetInput(VideoOptions *options)
+NetInput::NetInput(VideoOptions *options) : controls_(libcamera::controls::controls), changes_(0)
 {
     options_ = options;
 
@@ -47,6 +50,46 @@ NetInput::~NetInput()
 	close(fd_);
 }
 
+template <typename T>
+bool NetInput::set_option(T &option, json const &value)
+{
+  T new_value = value.get<T>();
+  if (new_value == option)
+    return false;
+  option = new_value;
+  return true;
+}
+
+// As above, but clamped to the range that Options::Parse allows.
+bool NetInput::set_option(float &option, json const &value, float min, float max)
+{
+  float new_value = std::clamp(value.get<float>(), min, max);
+  if (new_value == option)
+    return false;
+  option = new_value;
+  return true;
+}
+
+// Modes are given by name, so refuse ones we don't recognise rather than
+// letting the camera fail to start with them later.
+bool NetInput::set_mode(std::string &option, json const &value)
+{
+  std::string old_value = option;
+  if (!set_option(option, value))
+    return false;
+  try
+  {
+    options_->UpdateControlIndices();
+  }
+  catch (std::exception const &e)
+  {
+    std::cerr << "Ignoring config: " << e.what() << std::endl;
+    option = old_value;
+    return false;
+  }
+  return true;
+}
+
 void NetInput::manage_cx_cfg(json connection_cfg)
 {
   std::string prefix_output = "";
@@ -65,13 +108,14 @@ void NetInput::manage_cx_cfg(json connection_cfg)
   }
   if(connection_cfg.contains("listen"))
   {
-      options_->listen = connection_cfg.at("listen");
-      setOutput = true;
+      if(set_option(options_->listen, connection_cfg.at("listen")))
+        changes_ |= CONFIG_RESTART;
   }
   
-  if(setOutput)
+  if(setOutput && options_->output != prefix_output + postfix_output)
   {
       options_->output = prefix_output + postfix_output;  
+      changes_ |= CONFIG_RESTART;
   }
 }
 
@@ -85,75 +129,107 @@ void NetInput::manage_rec_cfg(json recording_cfg)
 
 void NetInput::manage_enc_cfg(json encoding_cfg)
 {
-  if(encoding_cfg.contains("fps"))
+  if(encoding_cfg.contains("fps") && set_option(options_->framerate, encoding_cfg.at("fps")))
   {
-    options_->framerate = encoding_cfg.at("fps");
+    if(options_->framerate > 0)
+    {
+      int64_t frame_time = 1000000 / options_->framerate; // in us
+      controls_.set(libcamera::controls::FrameDurationLimits, { frame_time, frame_time });
+      changes_ |= CONFIG_CONTROLS;
+    }
+    else
+      changes_ |= CONFIG_RESTART; // the camera's default limits only apply from the start
   }
-  if(encoding_cfg.contains("width"))
+  if(encoding_cfg.contains("width") && set_option(options_->width, encoding_cfg.at("width")))
   {
-    options_->width = encoding_cfg.at("width");
+    changes_ |= CONFIG_RESTART;
   }
-  if(encoding_cfg.contains("height"))
+  if(encoding_cfg.contains("height") && set_option(options_->height, encoding_cfg.at("height")))
   {  
-    options_->height = encoding_cfg.at("height");
+    changes_ |= CONFIG_RESTART;
   }
-  if(encoding_cfg.contains("codec"))
+  if(encoding_cfg.contains("codec") && set_option(options_->codec, encoding_cfg.at("codec")))
   {   
-    options_->codec = encoding_cfg.at("codec");
+    changes_ |= CONFIG_RESTART;
   }
-  if(encoding_cfg.contains("quality"))
+  if(encoding_cfg.contains("quality") && set_option(options_->quality, encoding_cfg.at("quality")))
   {   
-    options_->framerate = encoding_cfg.at("quality");
+    changes_ |= CONFIG_ENCODER;
   }    
 }
 
 void NetInput::manage_cb_cfg(json color_cfg)
 {
-  if(color_cfg.contains("awb"))
+  if(color_cfg.contains("awb") && set_mode(options_->awb, color_cfg.at("awb")))
   {
-    options_->awb = color_cfg.at("awb");
+    controls_.set(libcamera::controls::AwbMode, options_->awb_index);
+    changes_ |= CONFIG_CONTROLS;
   }
   if(color_cfg.contains("awbGains"))
   {
     auto arrayFormat = color_cfg.at("awbGains");
-    options_->awb_gain_r = arrayFormat[0];
-    options_->awb_gain_b = arrayFormat[1];
+    bool changed = set_option(options_->awb_gain_r, arrayFormat[0]);
+    changed = set_option(options_->awb_gain_b, arrayFormat[1]) || changed;
+    if(changed && options_->awb_gain_r && options_->awb_gain_b)
+    {
+      controls_.set(libcamera::controls::ColourGains, { options_->awb_gain_r, options_->awb_gain_b });
+      changes_ |= CONFIG_CONTROLS;
+    }
+    else if(changed)
+      changes_ |= CONFIG_RESTART; // automatic AWB only comes back on a restart
   }
-  if(color_cfg.contains("brightness"))
+  if(color_cfg.contains("brightness") &&
+     set_option(options_->brightness, color_cfg.at("brightness"), -1.0f, 1.0f))
   {
-    options_->brightness = color_cfg.at("brightness");
+    controls_.set(libcamera::controls::Brightness, options_->brightness);
+    changes_ |= CONFIG_CONTROLS;
   }
-  if(color_cfg.contains("contrast"))
+  if(color_cfg.contains("contrast") &&
+     set_option(options_->contrast, color_cfg.at("contrast"), 0.0f, 15.99f))
   {
-    options_->contrast = color_cfg.at("contrast");
+    controls_.set(libcamera::controls::Contrast, options_->contrast);
+    changes_ |= CONFIG_CONTROLS;
   }
-  if(color_cfg.contains("saturation"))
+  if(color_cfg.contains("saturation") &&
+     set_option(options_->saturation, color_cfg.at("saturation"), 0.0f, 15.99f))
   {
-    options_->saturation = color_cfg.at("saturation");
+    controls_.set(libcamera::controls::Saturation, options_->saturation);
+    changes_ |= CONFIG_CONTROLS;
   } 
 }
 
 void NetInput::manage_exp_cfg(json exposure_cfg)
 {
-  if(exposure_cfg.contains("exposure"))
+  if(exposure_cfg.contains("exposure") && set_mode(options_->exposure, exposure_cfg.at("exposure")))
   {
-    options_->exposure = exposure_cfg.at("exposure");
+    controls_.set(libcamera::controls::AeExposureMode, options_->exposure_index);
+    changes_ |= CONFIG_CONTROLS;
   }
-  if(exposure_cfg.contains("ev"))
+  if(exposure_cfg.contains("ev") && set_option(options_->ev, exposure_cfg.at("ev")))
   {
-    options_->ev = exposure_cfg.at("ev");
+    controls_.set(libcamera::controls::ExposureValue, options_->ev);
+    changes_ |= CONFIG_CONTROLS;
   }
-  if(exposure_cfg.contains("fixedGain"))
+  if(exposure_cfg.contains("fixedGain") && set_option(options_->gain, exposure_cfg.at("fixedGain")))
   {
-    options_->gain = exposure_cfg.at("fixedGain");
+    if(options_->gain)
+    {
+      controls_.set(libcamera::controls::AnalogueGain, options_->gain);
+      changes_ |= CONFIG_CONTROLS;
+    }
+    else
+      changes_ |= CONFIG_RESTART; // automatic gain only comes back on a restart
   }
-  if(exposure_cfg.contains("metering"))
+  if(exposure_cfg.contains("metering") && set_mode(options_->metering, exposure_cfg.at("metering")))
   {
-    options_->metering = exposure_cfg.at("metering");
+    controls_.set(libcamera::controls::AeMeteringMode, options_->metering_index);
+    changes_ |= CONFIG_CONTROLS;
   }
-  if(exposure_cfg.contains("sharpness"))
+  if(exposure_cfg.contains("sharpness") &&
+     set_option(options_->sharpness, exposure_cfg.at("sharpness"), 0.0f, 15.99f))
   {
-    options_->sharpness = exposure_cfg.at("sharpness");
+    controls_.set(libcamera::controls::Sharpness, options_->sharpness);
+    changes_ |= CONFIG_CONTROLS;
   } 
 }
 
@@ -165,57 +241,57 @@ void NetInput::manage_cam_cfg(json camera_cfg)
   }
   if(camera_cfg.contains("colorBalance"))
   {
-    manage_enc_cfg(camera_cfg.at("colorBalance"));
+    manage_cb_cfg(camera_cfg.at("colorBalance"));
   }
   if(camera_cfg.contains("exposure"))
   {
-    manage_enc_cfg(camera_cfg.at("exposure"));
+    manage_exp_cfg(camera_cfg.at("exposure"));
   }
 }
 
 
 
-bool NetInput::update_options(uint8_t *buffer)
+unsigned NetInput::update_options(uint8_t *buffer)
 {
-  bool force_restart = false;
+  changes_ = 0;
   try
   {
     json new_cfg = json::parse(buffer);
     if(new_cfg.contains("recording"))
     {
       manage_rec_cfg(new_cfg.at("recording"));
-      force_restart = true;
+      changes_ |= CONFIG_RECEIVED;
     }
     if(new_cfg.contains("camera"))
     {
       manage_cam_cfg(new_cfg.at("camera"));
-      force_restart = true;      
+      changes_ |= CONFIG_RECEIVED;
     }
-  }catch(json::parse_error& e)
+    if(new_cfg.contains("trigger") && new_cfg.at("trigger").get<bool>())
+    {
+      changes_ |= CONFIG_TRIGGER;
+    }
+  }catch(json::exception& e)
   { 
      std::cout << e.what() << std::endl;
   }
-  return force_restart;
+  return changes_;
 }
 
-size_t NetInput::poll_input()
+unsigned NetInput::poll_input()
 {
   static uint8_t inbound_buf[2048];
   poll(fd_to_check_, 1, 0);
   if (fd_to_check_[0].revents & POLLIN)
   {
-    size_t bytes_in = read(fd_to_check_[0].fd, inbound_buf, 2048);
+    ssize_t bytes_in = read(fd_to_check_[0].fd, inbound_buf, sizeof(inbound_buf) - 1);
     if(bytes_in > 0)
     {
       inbound_buf[bytes_in] = 0;
       std::cout << "Received config: " << bytes_in << " bytes" << std::endl;
       std::cout << inbound_buf << std::endl;
-      if(update_options(inbound_buf))
-      {
-          return bytes_in;
-      }
+      return update_options(inbound_buf);
     }
   }
   return 0;
 }
-
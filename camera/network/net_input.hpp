@@ -11,6 +11,8 @@
 #include <poll.h>
 #include <sys/un.h>
 
+#include <libcamera/controls.h>
+
 #include <nlohmann/json.hpp>
 
 #include "output.hpp"
@@ -19,6 +21,17 @@
 
 using json = nlohmann::json;
 
+// What a new configuration changed. Controls and encoder settings can be applied to
+// the running camera; anything else needs the stream to be restarted.
+enum ConfigChange : unsigned
+{
+    CONFIG_RECEIVED = 1, // a configuration arrived, even if it changed nothing
+    CONFIG_CONTROLS = 2, // camera controls changed, see controls()
+    CONFIG_ENCODER = 4,  // encoder settings changed
+    CONFIG_RESTART = 8,  // geometry, codec or output changed
+    CONFIG_TRIGGER = 16, // asked to write out the circular buffer
+};
+
 class NetInput
 {
 public:
@@ -26,8 +39,13 @@ public:
     NetInput(VideoOptions *options);
     ~NetInput();
 
-    size_t poll_input();
-    bool   update_options(uint8_t *buffer);
+    // Both return a mask of ConfigChange flags.
+    unsigned poll_input();
+    unsigned update_options(uint8_t *buffer);
+
+    // The camera controls changed by the configurations received so far. The
+    // application should pass these to LibcameraApp::SetControls, which empties them.
+    libcamera::ControlList &controls() { return controls_; }
 
 private:
     
@@ -36,6 +54,13 @@ private:
     struct pollfd fd_to_check_[1];
     
     VideoOptions *options_;
+    libcamera::ControlList controls_;
+    unsigned changes_;
+
+    template <typename T>
+    bool set_option(T &option, json const &value);
+    bool set_option(float &option, json const &value, float min, float max);
+    bool set_mode(std::string &option, json const &value);
 
     void manage_cx_cfg(json connection_cfg);
 
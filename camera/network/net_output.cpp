@@ -6,13 +6,29 @@
  */
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/udp.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+
 #include "net_output.hpp"
 
-NetOutput::NetOutput(VideoOptions const *options) : Output(options)
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+// How long the reader may take none of a frame we've started before we give up on it.
+constexpr std::chrono::milliseconds STALL_TIMEOUT(1000);
+
+NetOutput::NetOutput(VideoOptions const *options)
+	: Output(options), frames_skipped_(0), pending_offset_(0), skipped_(false), frame_id_(0), gso_(options->udp_header && options->udp_gso),
+	  reconnect_(options->reconnect), connected_(true), abort_(false), waiting_keyframe_(false), connecting_fd_(-1),
+	  frames_dropped_(0), reconnects_(0)
 {
 	char protocol[4];
 	char sock_path[20];
@@ -45,56 +61,17 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 		saddr_ptr_ = (const sockaddr *)&saddr_; // sendto needs these for udp
 		sockaddr_in_size_ = sizeof(struct sockaddr_in);
+		setSendBuffer(fd_);
+		return;
 	}
 	else if (strcmp(protocol, "tcp") == 0)
 	{
-		// WARNING: I've not actually tried this yet...
-		if (options->listen)
-		{
-			// We are the server.
-			int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (listen_fd < 0)
-				throw std::runtime_error("unable to open listen socket");
-
-			sockaddr_in server_saddr = {};
-			server_saddr.sin_family = AF_INET;
-			server_saddr.sin_addr.s_addr = INADDR_ANY;
-			server_saddr.sin_port = htons(port);
-
-			if (bind(listen_fd, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
-				throw std::runtime_error("failed to bind listen socket");
-			listen(listen_fd, 1);
-
-			if (options->verbose)
-				std::cerr << "Waiting for client to connect..." << std::endl;
-			fd_ = accept(listen_fd, (struct sockaddr *)&saddr_, &sockaddr_in_size_);
-			if (fd_ < 0)
-				throw std::runtime_error("accept socket failed");
-			if (options->verbose)
-				std::cerr << "Client connection accepted" << std::endl;
-
-			close(listen_fd);
-		}
-		else
-		{
-			// We are a client.
-			saddr_ = {};
-			saddr_.sin_family = AF_INET;
-			saddr_.sin_port = htons(port);
-			if (inet_aton(address.c_str(), &saddr_.sin_addr) == 0)
-				throw std::runtime_error("inet_aton failed for " + address);
-
-			fd_ = socket(AF_INET, SOCK_STREAM, 0);
-			if (fd_ < 0)
-				throw std::runtime_error("unable to open client socket");
-
-			if (options->verbose)
-				std::cerr << "Connecting to server..." << std::endl;
-			if (connect(fd_, (struct sockaddr *)&saddr_, sizeof(sockaddr_in)) < 0)
-				throw std::runtime_error("connect to server failed");
-			if (options->verbose)
-				std::cerr << "Connected" << std::endl;
-		}
+		// We are a client; listening is for TcpServerOutput.
+		saddr_ = {};
+		saddr_.sin_family = AF_INET;
+		saddr_.sin_port = htons(port);
+		if (inet_aton(address.c_str(), &saddr_.sin_addr) == 0)
+			throw std::runtime_error("inet_aton failed for " + address);
 
 		saddr_ptr_ = NULL; // sendto doesn't want these for tcp
 		sockaddr_in_size_ = 0;
@@ -105,23 +82,167 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		sock_ = {};
     	sock_.sun_family = AF_UNIX;
     	strncpy(sock_.sun_path, sock_path, end-start);
-
-    	fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
-		if (fd_ < 0) {
-			throw std::runtime_error("unable to open unix socket");
-		}
-
-		if (connect(fd_, (struct sockaddr *) &sock_, sizeof(struct sockaddr_un)) == -1) {
-      		throw std::runtime_error("unable to connect to unix socket");
-    	}
+		saddr_ptr_ = NULL;
 	}
 	else
 		throw std::runtime_error("unrecognised network protocol " + options->output);
+
+	fd_ = openSocket();
+	if (options->verbose)
+		std::cerr << "Connecting to server..." << std::endl;
+	if (!connectSocket(fd_))
+	{
+		if (!reconnect_)
+			throw std::runtime_error(unix_socket_ ? "unable to connect to unix socket" : "connect to server failed");
+		std::cerr << "NetOutput: unable to connect, will keep trying" << std::endl;
+		close(fd_);
+		fd_ = -1;
+		connected_ = false;
+	}
+	else if (options->verbose)
+		std::cerr << "Connected" << std::endl;
+
+	if (reconnect_)
+		reconnect_thread_ = std::thread(&NetOutput::reconnectThread, this);
 }
 
 NetOutput::~NetOutput()
 {
+	if (reconnect_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+			// This makes a connect that's still trying give up at once.
+			if (connecting_fd_ >= 0)
+				shutdown(connecting_fd_, SHUT_RDWR);
+		}
+		cond_.notify_all();
+		reconnect_thread_.join();
+	}
+	// Give the reader the end of the last frame, if it will take it.
+	try
+	{
+		while (fd_ >= 0 && !pending_.empty() && !sendPending())
+		{
+			pollfd p = { fd_, POLLOUT, 0 };
+			poll(&p, 1, STALL_TIMEOUT.count());
+		}
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "NetOutput: " << e.what() << std::endl;
+	}
+	if (options_->verbose && frames_skipped_)
+		std::cerr << "NetOutput: skipped " << frames_skipped_ << " frames the reader had no room for" << std::endl;
+	if (options_->verbose && reconnect_)
+		std::cerr << "NetOutput: reconnected " << reconnects_ << " times, dropped " << frames_dropped_
+				  << " frames while disconnected" << std::endl;
+	if (fd_ >= 0)
+		close(fd_);
+}
+
+int NetOutput::openSocket()
+{
+	int fd = socket(unix_socket_ ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw std::runtime_error(unix_socket_ ? "unable to open unix socket" : "unable to open client socket");
+	return fd;
+}
+
+bool NetOutput::connectSocket(int fd)
+{
+	int ret = unix_socket_ ? connect(fd, (struct sockaddr *)&sock_, sizeof(struct sockaddr_un))
+						   : connect(fd, (struct sockaddr *)&saddr_, sizeof(sockaddr_in));
+	if (ret < 0)
+		return false;
+
+	// We'd rather skip a frame than have the encoder wait on a slow reader.
+	if (unix_socket_ && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		throw std::runtime_error("unable to make unix socket non-blocking");
+	setSendBuffer(fd);
+	return true;
+}
+
+void NetOutput::setSendBuffer(int fd)
+{
+	if (!options_->sndbuf)
+		return;
+	int sndbuf = options_->sndbuf;
+	socklen_t len = sizeof(sndbuf);
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, len) < 0)
+		throw std::runtime_error("unable to set socket send buffer size");
+	// The kernel doubles what we ask for, and may cap it at net.core.wmem_max.
+	if (options_->verbose && getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == 0)
+		std::cerr << "NetOutput: send buffer " << sndbuf << " bytes" << std::endl;
+}
+
+// The first wait before trying to connect again, which doubles up to --reconnect-max.
+constexpr unsigned int RECONNECT_MIN_MS = 100;
+
+void NetOutput::disconnect(char const *reason)
+{
+	std::cerr << "NetOutput: connection lost (" << reason << "), reconnecting" << std::endl;
+	std::lock_guard<std::mutex> lock(mutex_);
 	close(fd_);
+	fd_ = -1;
+	connected_ = false;
+	// A new connection starts a new stream.
+	pending_.clear();
+	pending_offset_ = 0;
+	cond_.notify_all();
+}
+
+void NetOutput::reconnectThread()
+{
+	unsigned int delay_ms = RECONNECT_MIN_MS;
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		cond_.wait(lock, [this] { return abort_ || !connected_; });
+		if (abort_)
+			return;
+
+		int fd = -1;
+		bool ok = false;
+		try
+		{
+			fd = openSocket();
+			connecting_fd_ = fd;
+			lock.unlock();
+			ok = connectSocket(fd);
+			lock.lock();
+			connecting_fd_ = -1;
+		}
+		catch (std::exception const &e)
+		{
+			// Most likely out of file descriptors, which might not last.
+			if (!lock.owns_lock())
+				lock.lock();
+			connecting_fd_ = -1;
+			std::cerr << "NetOutput: " << e.what() << std::endl;
+		}
+
+		if (ok && !abort_)
+		{
+			// The output thread only uses fd_ once it sees connected_.
+			fd_ = fd;
+			connected_ = true;
+			waiting_keyframe_ = true;
+			reconnects_++;
+			delay_ms = RECONNECT_MIN_MS;
+			std::cerr << "NetOutput: reconnected" << std::endl;
+			continue;
+		}
+		if (fd >= 0)
+			close(fd);
+		if (abort_)
+			return;
+		if (options_->verbose)
+			std::cerr << "NetOutput: connect failed, retrying in " << delay_ms << "ms" << std::endl;
+		cond_.wait_for(lock, std::chrono::milliseconds(delay_ms), [this] { return abort_; });
+		delay_ms = std::min(delay_ms * 2, options_->reconnect_max);
+	}
 }
 
 // Maximum size that sendto will accept.
@@ -144,48 +265,261 @@ int count_digits(int x)
         10)))))))));  
 }  
 
-void NetOutput::outputUnixSocket(void *mem, size_t size, int64_t timestamp_us, uint32_t /*flags*/)
+bool NetOutput::sendPending()
 {
-	int ret = 0;
+	while (pending_offset_ < pending_.size())
+	{
+		ssize_t ret = send(fd_, pending_.data() + pending_offset_, pending_.size() - pending_offset_, MSG_NOSIGNAL);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				throw std::runtime_error("failed to send data on unix socket");
+			if (std::chrono::steady_clock::now() - pending_progress_ > STALL_TIMEOUT)
+				throw std::runtime_error("unix socket reader stalled");
+			return false;
+		}
+		pending_offset_ += ret;
+		pending_progress_ = std::chrono::steady_clock::now();
+	}
+	pending_.clear();
+	pending_offset_ = 0;
+	return true;
+}
 
-	// TODO : don't hard code the static length of the header here
-	size_t header_length = 17+count_digits(size);
+void NetOutput::outputUnixSocket(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t flags)
+{
+	// The rest of the last frame must go before anything new, so the reader never loses its
+	// place in the stream. Until it has, whole new frames are skipped, and after that, those
+	// up to the next keyframe, which may depend on them.
+	if ((!pending_.empty() && !sendPending()) || (skipped_ && !(flags & FLAG_KEYFRAME)))
+	{
+		frames_skipped_++;
+		skipped_ = true;
+		if (options_->verbose)
+			std::cerr << "NetOutput: unix socket full, skipping frame" << std::endl;
+		return;
+	}
+	skipped_ = false;
+
+	// The header, with the topic and number of bytes that follow the line break, goes out
+	// with the frame and EOL in a single call.
+	char header[32];
+	int header_length = snprintf(header, sizeof(header), "PUB frame.jpeg %lu\r\n", static_cast<unsigned long>(size));
+	iovec iov[3] = { { header, static_cast<size_t>(header_length) }, { mem, size }, { EOL, 2 } };
+	msghdr msg = {};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	ssize_t ret;
+	do
+		ret = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+	while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			throw std::runtime_error("failed to send data on unix socket");
+		frames_skipped_++;
+		skipped_ = true;
+		if (options_->verbose)
+			std::cerr << "NetOutput: unix socket full, skipping frame" << std::endl;
+		return;
+	}
 
-	// Prepare the header string with topic and number of bytes that follow the line break
-	char header[100] = "";
-	sprintf(header, "PUB frame.jpeg %lu\r\n", static_cast<unsigned long>(size));
+	// Keep a copy of whatever didn't fit, to finish on later calls rather than wait for it here.
+	size_t sent = ret;
+	for (iovec const &piece : iov)
+	{
+		size_t done = std::min(sent, piece.iov_len);
+		pending_.insert(pending_.end(), (uint8_t *)piece.iov_base + done, (uint8_t *)piece.iov_base + piece.iov_len);
+		sent -= done;
+	}
+	if (!pending_.empty())
+		pending_progress_ = std::chrono::steady_clock::now();
+}
 
-	// if (options_->verbose)
-	// 	std::cerr << "NetOutput: output buffer " << mem << " size " << size << "\n";
+// With --udp-header, each fragment starts with these bytes, all big-endian: "CR", version,
+// flags (1 for a keyframe, 2 where recording restarts), frame id (32 bits), fragment index
+// and count (16 bits each), frame size (32 bits) and timestamp in microseconds (64 bits).
+constexpr size_t FRAGMENT_HEADER_SIZE = 24;
+constexpr uint8_t FRAGMENT_VERSION = 1;
+// The kernel makes at most this many datagrams from one GSO send.
+constexpr size_t MAX_GSO_SEGMENTS = 64;
+// And sendmmsg takes at most this many messages at once.
+constexpr size_t MAX_BATCH = 1024;
+
+static void put_be(uint8_t *p, uint64_t value, int bytes)
+{
+	for (int i = bytes - 1; i >= 0; i--, value >>= 8)
+		p[i] = value;
+}
 
-	if (write(fd_, header, header_length) < 0) {
-		throw std::runtime_error("failed to send data on unix socket");
+void NetOutput::outputUdp(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	uint8_t *data = (uint8_t *)mem;
+	char header[32];
+	iovs_.clear();
+	datagrams_.clear();
+	size_t first = 0;
+	// iovs_ must have room reserved for everything before we start, as datagrams point into it.
+	auto add_datagram = [this, &first]() {
+		mmsghdr datagram = {};
+		datagram.msg_hdr.msg_name = &saddr_;
+		datagram.msg_hdr.msg_namelen = sockaddr_in_size_;
+		datagram.msg_hdr.msg_iov = &iovs_[first];
+		datagram.msg_hdr.msg_iovlen = iovs_.size() - first;
+		datagrams_.push_back(datagram);
+		first = iovs_.size();
+	};
+
+	size_t per_message = 1;
+	if (options_->udp_header)
+	{
+		size_t payload = options_->udp_payload;
+		size_t count = std::max<size_t>(1, (size + payload - 1) / payload);
+		if (count > 0xffff)
+			throw std::runtime_error("frame too big for udp fragments");
+		// With GSO, one message holds as many fragments as the kernel will split up for us.
+		if (gso_)
+			per_message = std::min(MAX_GSO_SEGMENTS, MAX_UDP_SIZE / (FRAGMENT_HEADER_SIZE + payload));
+		fragment_headers_.resize(count * FRAGMENT_HEADER_SIZE);
+		iovs_.reserve(2 * count);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			uint8_t *h = &fragment_headers_[i * FRAGMENT_HEADER_SIZE];
+			h[0] = 'C';
+			h[1] = 'R';
+			h[2] = FRAGMENT_VERSION;
+			h[3] = flags;
+			put_be(h + 4, frame_id_, 4);
+			put_be(h + 8, i, 2);
+			put_be(h + 10, count, 2);
+			put_be(h + 12, size, 4);
+			put_be(h + 16, timestamp_us, 8);
+			iovs_.push_back({ h, FRAGMENT_HEADER_SIZE });
+			size_t offset = i * payload;
+			if (offset < size)
+				iovs_.push_back({ data + offset, std::min(payload, size - offset) });
+			if ((i + 1) % per_message == 0 || i + 1 == count)
+				add_datagram();
+		}
 	}
+	else
+	{
+		// The PUB header, frame and EOL, cut into datagrams as big as UDP allows.
+		int header_length = snprintf(header, sizeof(header), "PUB frame.jpeg %lu\r\n", static_cast<unsigned long>(size));
+		iovec pieces[3] = { { header, static_cast<size_t>(header_length) }, { mem, size }, { EOL, 2 } };
+		iovs_.reserve((header_length + size + 2) / MAX_UDP_SIZE + 4);
 
-	if ((ret = write(fd_, mem, size)) < 0) {
-		throw std::runtime_error("failed to send data on unix socket");
+		size_t room = MAX_UDP_SIZE;
+		for (iovec &piece : pieces)
+		{
+			for (size_t offset = 0; offset < piece.iov_len;)
+			{
+				if (!room)
+				{
+					add_datagram();
+					room = MAX_UDP_SIZE;
+				}
+				size_t length = std::min(room, piece.iov_len - offset);
+				iovs_.push_back({ (uint8_t *)piece.iov_base + offset, length });
+				offset += length;
+				room -= length;
+			}
+		}
+		add_datagram();
 	}
 
-	if (write(fd_, &EOL, 2) < 0) {
-		throw std::runtime_error("failed to send data on unix socket");
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		cmsghdr align;
+	} control = {};
+	if (per_message > 1)
+	{
+		cmsghdr *cmsg = &control.align;
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		uint16_t segment_size = FRAGMENT_HEADER_SIZE + options_->udp_payload;
+		memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+		for (mmsghdr &datagram : datagrams_)
+		{
+			if (datagram.msg_hdr.msg_iovlen > 2) // more than one fragment
+			{
+				datagram.msg_hdr.msg_control = control.buf;
+				datagram.msg_hdr.msg_controllen = sizeof(control.buf);
+			}
+		}
 	}
 
-	// if (options_->verbose)
-	// 	std::cerr << "  wrote " << ret << "\n";
+	for (size_t sent = 0; sent < datagrams_.size();)
+	{
+		int n = sendmmsg(fd_, &datagrams_[sent], std::min(datagrams_.size() - sent, MAX_BATCH), 0);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			// Not every kernel or network device can do GSO, so we find out on the first frame.
+			if (gso_ && frame_id_ == 0 && sent == 0)
+			{
+				if (options_->verbose)
+					std::cerr << "NetOutput: UDP GSO unavailable (" << strerror(errno) << "), sending datagrams"
+							  << std::endl;
+				gso_ = false;
+				outputUdp(mem, size, timestamp_us, flags);
+				return;
+			}
+			throw std::runtime_error("failed to send data on udp socket");
+		}
+		sent += n;
+	}
+	frame_id_++;
 }
 
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t /*flags*/)
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
-	if (unix_socket_) {
-		outputUnixSocket(mem, size, timestamp_us, 0);
+	if (saddr_ptr_) {
+		outputUdp(mem, size, timestamp_us, flags);
 		return;
 	}
 
+	if (reconnect_)
+	{
+		// Part way through reconnecting, or a new connection that must start with a keyframe.
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!connected_ || (waiting_keyframe_ && !(flags & FLAG_KEYFRAME)))
+		{
+			frames_dropped_++;
+			return;
+		}
+		waiting_keyframe_ = false;
+	}
+
+	try
+	{
+		if (unix_socket_)
+			outputUnixSocket(mem, size, timestamp_us, flags);
+		else
+			outputTcp(mem, size, timestamp_us, flags);
+	}
+	catch (std::exception const &e)
+	{
+		if (!reconnect_)
+			throw;
+		frames_dropped_++;
+		disconnect(e.what());
+	}
+}
+
+void NetOutput::outputTcp(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+{
 	struct msghdr msg = {};
 	struct iovec iov[3] = {{}, {}, {}};
 	int ret = 0;
 
-	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
+	size_t max_size = size; // only tcp gets this far
 
 	if (options_->verbose)
 		std::cerr << "NetOutput: output buffer " << mem << " size " << size << "\n";
@@ -228,7 +562,7 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint3
 	msg.msg_namelen = sockaddr_in_size_;
 	
 	// Send the composite packet containing header and start of the image data
-	if ((ret = sendmsg(fd_, &msg, 0)) < 0) {
+	if ((ret = sendmsg(fd_, &msg, MSG_NOSIGNAL)) < 0) {
 		std::cerr << "sendmsg err " << ret << "\n";
 		throw std::runtime_error("failed to send data on socket");
 	}
@@ -242,7 +576,7 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint3
 
 	// Send image data until we have less than `max_size` left to send
 	while (size >= max_size) {
-		if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0) {
+		if (sendto(fd_, ptr, bytes_to_send, MSG_NOSIGNAL, saddr_ptr_, sockaddr_in_size_) < 0) {
 			throw std::runtime_error("failed to send data on socket");
 		}
 
@@ -268,7 +602,7 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint3
 	msg.msg_iovlen = 2;
 
 	// Send the composite packet
-	if ((ret = sendmsg(fd_, &msg, 0)) < 0) {
+	if ((ret = sendmsg(fd_, &msg, MSG_NOSIGNAL)) < 0) {
 		std::cerr << "sendmsg err " << ret << "\n";
 		throw std::runtime_error("failed to send data on socket");
 	}
@@ -276,7 +610,7 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint3
 	// If size + 1 happens to match max_length, then the EOL bytes will split accross two packets
 	// Here, we send the last EOL byte if that occurs
 	if (max_size - size < 2) {
-		sendto(fd_, &EOL[1], 1, 0, saddr_ptr_, sockaddr_in_size_);
+		sendto(fd_, &EOL[1], 1, MSG_NOSIGNAL, saddr_ptr_, sockaddr_in_size_);
 	}
 	
 }
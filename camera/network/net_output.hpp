@@ -8,10 +8,20 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/socket.h>
 #include <sys/un.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "output.hpp"
 
+// With --reconnect, a tcp:// or sck:// output that can't connect, or loses its connection,
+// keeps trying in the background with exponential backoff. Frames are dropped (and counted)
+// meanwhile, and sending resumes at the first keyframe after it connects again.
 class NetOutput : public Output
 {
 public:
@@ -20,13 +30,49 @@ public:
 
 protected:
 	void outputUnixSocket(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+	void outputUdp(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+	void outputTcp(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	// For tcp and unix sockets. connectSocket returns false if the other end isn't there.
+	int openSocket();
+	bool connectSocket(int fd);
+	void setSendBuffer(int fd);
+	void disconnect(char const *reason);
+	void reconnectThread();
+	// Send what's left of a unix socket frame, returning true once it's all gone.
+	bool sendPending();
+
 	int fd_;
+	unsigned int frames_skipped_; // unix socket frames the reader had no room for
+	// The part of a unix socket frame that didn't fit, which goes before anything else, and
+	// when the reader last took any of it.
+	std::vector<uint8_t> pending_;
+	size_t pending_offset_;
+	std::chrono::steady_clock::time_point pending_progress_;
+	bool skipped_; // so wait for a keyframe
 	bool unix_socket_;
 	sockaddr_in saddr_;
 	sockaddr_un sock_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+
+	// What outputUdp sends in one go, kept from frame to frame to save allocating it.
+	std::vector<mmsghdr> datagrams_;
+	std::vector<iovec> iovs_;
+	std::vector<uint8_t> fragment_headers_;
+	uint32_t frame_id_;
+	bool gso_;
+
+	bool reconnect_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::thread reconnect_thread_;
+	bool connected_;
+	bool abort_;
+	bool waiting_keyframe_;
+	int connecting_fd_; // so that we can interrupt a connect when we finish
+	unsigned int frames_dropped_; // while disconnected
+	unsigned int reconnects_;
 };
@@ -6,10 +6,21 @@
  */
 
 #include <cinttypes>
+#include <memory>
 #include <stdexcept>
 
+#include "core/frame_trace.hpp"
+
+#include "circular_output.hpp"
+#include "dmabuf_output.hpp"
+#include "file_output.hpp"
+#include "http_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
+#include "queued_output.hpp"
+#include "rtp_output.hpp"
+#include "shm_output.hpp"
+#include "tcp_server_output.hpp"
 
 int64_t timestamp_now() 
 {
@@ -20,14 +31,6 @@ int64_t timestamp_now()
 Output::Output(VideoOptions const *options)
   : options_(options), state_(WAITING_KEYFRAME), fp_timestamps_(nullptr), time_offset_(0), last_timestamp_(0)
 {
-  if (!options->save_pts.empty())
-  {
-    fp_timestamps_ = fopen(options->save_pts.c_str(), "w");
-    if (!fp_timestamps_)
-      throw std::runtime_error("Failed to open timestamp file " + options->save_pts);
-    fprintf(fp_timestamps_, "frame,encode_ready,output_done\n");
-  }
-
   start_time_ = timestamp_now();
 
   enable_ = !options->pause;
@@ -39,6 +42,16 @@ Output::~Output()
     fclose(fp_timestamps_);
 }
 
+void Output::openTimestamps()
+{
+  if (options_->save_pts.empty())
+    return;
+  fp_timestamps_ = fopen(options_->save_pts.c_str(), "w");
+  if (!fp_timestamps_)
+    throw std::runtime_error("Failed to open timestamp file " + options_->save_pts);
+  fprintf(fp_timestamps_, "frame,encode_ready,output_done\n");
+}
+
 void Output::Signal()
 {
   enable_ = !enable_;
@@ -64,6 +77,7 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
     time_offset_ = timestamp_us - last_timestamp_;
   last_timestamp_ = timestamp_us - time_offset_;
 
+  FrameTrace::Record(timestamp_us, FrameTrace::OUTPUT_START);
   try{
     outputBuffer(mem, size, last_timestamp_, flags);
   }
@@ -71,6 +85,7 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
      std::cout << e.what() << std::endl;
      Signal();
   }
+  FrameTrace::Record(timestamp_us, FrameTrace::OUTPUT_END);
   
   int64_t done_time = timestamp_now();
 
@@ -81,6 +96,13 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
   }
 }
 
+void Output::FrameDropped(int64_t timestamp_us)
+{
+  // Frames the encoder dropped are listed with no encode or output times.
+  if (fp_timestamps_ && state_ == RUNNING)
+    fprintf(fp_timestamps_, "%" PRId64 ",,\n", (timestamp_us - time_offset_) / 1000);
+}
+
 void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
   // Supply this so that a vanilla Output gives you an object that outputs no buffers.
@@ -88,8 +110,33 @@ void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t
 
 Output *Output::Create(VideoOptions const *options)
 {
-  if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0 || strncmp(options->output.c_str(), "sck://", 6) == 0)
-    return new NetOutput(options);
+  Output *output;
+  if (strncmp(options->output.c_str(), "tcp://", 6) == 0 && options->listen)
+    output = new TcpServerOutput(options);
+  else if (strncmp(options->output.c_str(), "http://", 7) == 0)
+    output = new HttpOutput(options);
+  else if (strncmp(options->output.c_str(), "rtp://", 6) == 0)
+    output = new RtpOutput(options);
+  else if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0 || strncmp(options->output.c_str(), "sck://", 6) == 0)
+    output = new NetOutput(options);
+  else if (strncmp(options->output.c_str(), "shm://", 6) == 0)
+    output = new ShmOutput(options);
+  else if (strncmp(options->output.c_str(), "dmabuf://", 9) == 0)
+    output = new DmabufOutput(options); // which never copies a frame, so Parse won't let it be wrapped
+  else if (!options->output.empty())
+    output = new FileOutput(options);
   else
-    return new Output(options);
+    output = new Output(options);
+
+  // A circular buffer holds frames back from the real output until something triggers it,
+  // and a queue outside everything else keeps all of them off the encoder's thread.
+  if (options->circular)
+    output = new CircularOutput(options, std::unique_ptr<Output>(output));
+  if (options->output_queue)
+    output = new QueuedOutput(options, std::unique_ptr<Output>(output));
+
+  // Only the outermost output sees every frame as it arrives, so only it keeps the timestamp file.
+  std::unique_ptr<Output> outer(output);
+  outer->openTimestamps();
+  return outer.release();
 }
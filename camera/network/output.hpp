@@ -10,6 +10,7 @@
 #include <cstdio>
 #include <chrono>
 #include <atomic>
+#include <functional>
 
 #include "core/video_options.hpp"
 
@@ -21,9 +22,21 @@ public:
   Output(VideoOptions const *options);
   virtual ~Output();
   virtual void Signal(); // a derived class might redefine what this means
+  virtual void Trigger() {} // an event worth recording happened; most outputs don't care
   void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+  void FrameDropped(int64_t timestamp_us);
+
+  // Outputs that pass on the camera's own buffers, rather than copying them, take each one
+  // through BufferReady instead of OutputReady, and give it back to the buffer-done callback.
+  typedef std::function<void(void *)> BufferDoneCallback;
+  virtual bool TakesBuffers() const { return false; }
+  virtual void BufferReady(void *mem, int fd, size_t size, unsigned int width, unsigned int height,
+                           unsigned int stride, int64_t timestamp_us) {}
+  void SetBufferDoneCallback(BufferDoneCallback callback) { buffer_done_callback_ = callback; }
 
 protected:
+  friend class CircularOutput; // these two hand their frames on to another output
+  friend class QueuedOutput;
   enum Flag
   {
     FLAG_NONE = 0,
@@ -32,6 +45,7 @@ protected:
   };
   virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
   VideoOptions const *options_;
+  BufferDoneCallback buffer_done_callback_;
 
 private:
   enum State
@@ -40,6 +54,8 @@ private:
     WAITING_KEYFRAME = 1,
     RUNNING = 2
   };
+  // Opened by Create for the output it returns, and never for the outputs that one wraps.
+  void openTimestamps();
   State state_;
   std::atomic<bool> enable_;
   FILE *fp_timestamps_;
@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * queued_output.cpp - hand frames to another output on a thread of its own.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "queued_output.hpp"
+
+// Enough spare buffers to refill a queue of typical frames without allocating.
+constexpr unsigned int MAX_SPARE = 16;
+
+QueuedOutput::QueuedOutput(VideoOptions const *options, std::unique_ptr<Output> sink)
+	: Output(options), sink_(std::move(sink)), budget_(static_cast<size_t>(options->output_queue) << 10),
+	  queued_bytes_(0), dropping_(false), abort_(false), frames_sent_(0), frames_dropped_(0), max_queued_bytes_(0),
+	  total_send_us_(0), max_send_us_(0)
+{
+	if (options->output_policy == "drop-oldest")
+		policy_ = POLICY_DROP_OLDEST;
+	else if (options->output_policy == "drop-to-keyframe")
+		policy_ = POLICY_DROP_TO_KEYFRAME;
+	else
+		policy_ = POLICY_BLOCK;
+	output_thread_ = std::thread(&QueuedOutput::outputThread, this);
+}
+
+QueuedOutput::~QueuedOutput()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	queue_cond_var_.notify_one();
+	output_thread_.join();
+
+	if (options_->verbose && frames_sent_)
+		std::cerr << "QueuedOutput: sent " << frames_sent_ << " frames, mean " << total_send_us_ / frames_sent_
+				  << "us max " << max_send_us_ << "us each, dropped " << frames_dropped_ << ", queue peaked at "
+				  << max_queued_bytes_ << " bytes" << std::endl;
+}
+
+void QueuedOutput::Trigger()
+{
+	sink_->Trigger();
+}
+
+void QueuedOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	if (dropping_ && !(flags & FLAG_KEYFRAME))
+	{
+		frames_dropped_++;
+		return;
+	}
+	// A frame bigger than the whole budget still goes, but only into an empty queue.
+	while (!queue_.empty() && queued_bytes_ + size > budget_)
+	{
+		if (policy_ == POLICY_BLOCK)
+			space_cond_var_.wait(lock);
+		else if (policy_ == POLICY_DROP_OLDEST)
+		{
+			queued_bytes_ -= queue_.front().data.size();
+			spare_.push_back(std::move(queue_.front().data));
+			queue_.pop_front();
+			frames_dropped_++;
+		}
+		else
+		{
+			dropping_ = true;
+			frames_dropped_++;
+			return;
+		}
+	}
+	dropping_ = false;
+
+	Item item;
+	if (!spare_.empty())
+	{
+		item.data = std::move(spare_.back());
+		spare_.pop_back();
+	}
+	item.data.resize(size);
+	memcpy(item.data.data(), mem, size);
+	item.timestamp_us = timestamp_us;
+	item.flags = flags;
+	queue_.push_back(std::move(item));
+	queued_bytes_ += size;
+	max_queued_bytes_ = std::max(max_queued_bytes_, queued_bytes_);
+	lock.unlock();
+	queue_cond_var_.notify_one();
+}
+
+void QueuedOutput::outputThread()
+{
+	while (true)
+	{
+		Item item;
+		size_t queued_frames, queued_bytes;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			queue_cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			if (queue_.empty())
+				return;
+			item = std::move(queue_.front());
+			queue_.pop_front();
+			queued_frames = queue_.size();
+			queued_bytes = queued_bytes_;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		try
+		{
+			sink_->outputBuffer(item.data.data(), item.data.size(), item.timestamp_us, item.flags);
+		}
+		catch (std::exception const &e)
+		{
+			std::cout << e.what() << std::endl;
+			Signal();
+		}
+		int64_t send_us =
+			std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+		if (options_->verbose)
+			std::cerr << "QueuedOutput: sent frame " << item.timestamp_us << " in " << send_us << "us, queue "
+					  << queued_frames << " frames " << queued_bytes << " bytes" << std::endl;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			queued_bytes_ -= item.data.size();
+			frames_sent_++;
+			total_send_us_ += send_us;
+			max_send_us_ = std::max(max_send_us_, send_us);
+			if (spare_.size() < MAX_SPARE)
+				spare_.push_back(std::move(item.data));
+		}
+		space_cond_var_.notify_one();
+	}
+}
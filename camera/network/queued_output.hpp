@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * queued_output.hpp - hand frames to another output on a thread of its own.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// Copies each frame into a queue of at most --output-queue KB and returns at once, so that
+// a slow disk or socket holds up only our thread and never the encoder. When the queue is
+// full, --output-policy says whether to wait for room, drop the oldest queued frames, or
+// drop frames until the next keyframe (which keeps an H.264 stream decodable).
+class QueuedOutput : public Output
+{
+public:
+	QueuedOutput(VideoOptions const *options, std::unique_ptr<Output> sink);
+	// Sends whatever is still queued before returning.
+	~QueuedOutput();
+	void Trigger() override;
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	enum Policy
+	{
+		POLICY_BLOCK,
+		POLICY_DROP_OLDEST,
+		POLICY_DROP_TO_KEYFRAME
+	} policy_;
+
+	struct Item
+	{
+		std::vector<uint8_t> data;
+		int64_t timestamp_us;
+		uint32_t flags;
+	};
+
+	void outputThread();
+
+	std::unique_ptr<Output> sink_;
+	size_t budget_;
+	std::deque<Item> queue_;
+	std::vector<std::vector<uint8_t>> spare_; // buffers from sent frames, for reuse
+	size_t queued_bytes_; // including the frame being sent
+	bool dropping_; // until the next keyframe
+	bool abort_;
+	std::mutex mutex_;
+	std::condition_variable queue_cond_var_;
+	std::condition_variable space_cond_var_;
+	std::thread output_thread_;
+
+	unsigned int frames_sent_;
+	unsigned int frames_dropped_;
+	size_t max_queued_bytes_;
+	int64_t total_send_us_;
+	int64_t max_send_us_;
+};
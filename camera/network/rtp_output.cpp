@@ -0,0 +1,455 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * rtp_output.cpp - send output as RTP over UDP.
+ */
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "rtp_output.hpp"
+
+constexpr uint8_t PAYLOAD_TYPE_JPEG = 26;
+constexpr uint8_t PAYLOAD_TYPE_H264 = 96;
+// Packets sent together, between pauses.
+constexpr size_t BURST = 8;
+// RFC 2435 headers.
+constexpr size_t JPEG_HEADER_SIZE = 8;
+constexpr size_t RESTART_HEADER_SIZE = 4;
+constexpr size_t QUANT_HEADER_SIZE = 4 + 2 * 64;
+// RFC 6184 FU-A indicator and header.
+constexpr size_t FU_A_HEADER_SIZE = 2;
+// Frames waiting for the sender thread, beyond which new ones are skipped.
+constexpr size_t MAX_QUEUED = 4;
+// H.264 NAL unit types.
+constexpr uint8_t NAL_IDR = 5;
+constexpr uint8_t NAL_SPS = 7;
+constexpr uint8_t NAL_PPS = 8;
+
+static std::string base64(std::vector<uint8_t> const &data)
+{
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < data.size(); i += 3)
+	{
+		uint32_t n = data[i] << 16;
+		if (i + 1 < data.size())
+			n |= data[i + 1] << 8;
+		if (i + 2 < data.size())
+			n |= data[i + 2];
+		out += chars[(n >> 18) & 63];
+		out += chars[(n >> 12) & 63];
+		out += i + 1 < data.size() ? chars[(n >> 6) & 63] : '=';
+		out += i + 2 < data.size() ? chars[n & 63] : '=';
+	}
+	return out;
+}
+
+RtpOutput::RtpOutput(VideoOptions const *options)
+	: Output(options), h264_(options->codec == "h264"), sequence_(0), last_timestamp_us_(0), frames_skipped_(0),
+	  waiting_keyframe_(false), abort_(false)
+{
+	int a, b, c, d, port;
+	if (sscanf(options->output.c_str(), "rtp://%d.%d.%d.%d:%d", &a, &b, &c, &d, &port) != 5)
+		throw std::runtime_error("bad network address " + options->output);
+	std::string address = options->output.substr(6, options->output.rfind(':') - 6);
+
+	saddr_ = {};
+	saddr_.sin_family = AF_INET;
+	saddr_.sin_port = htons(port);
+	if (inet_aton(address.c_str(), &saddr_.sin_addr) == 0)
+		throw std::runtime_error("inet_aton failed for " + address);
+	fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("unable to open udp socket");
+	if (options->sndbuf)
+	{
+		int sndbuf = options->sndbuf;
+		setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	}
+
+	// RFC 3550 wants these to start out random.
+	std::random_device random;
+	ssrc_ = random();
+	sequence_ = random();
+	timestamp_offset_ = random();
+
+	writeSdp();
+	sender_thread_ = std::thread(&RtpOutput::senderThread, this);
+}
+
+RtpOutput::~RtpOutput()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_one();
+	sender_thread_.join();
+	if (options_->verbose && frames_skipped_)
+		std::cerr << "RtpOutput: skipped " << frames_skipped_ << " frames" << std::endl;
+	close(fd_);
+}
+
+std::string RtpOutput::sdp() const
+{
+	std::string address = inet_ntoa(saddr_.sin_addr);
+	uint8_t payload_type = h264_ ? PAYLOAD_TYPE_H264 : PAYLOAD_TYPE_JPEG;
+	std::ostringstream sdp;
+	sdp << "v=0\r\n"
+		<< "o=- " << ssrc_ << " 1 IN IP4 " << address << "\r\n"
+		<< "s=libcamera-bridge\r\n"
+		<< "c=IN IP4 " << address << "\r\n"
+		<< "t=0 0\r\n"
+		<< "m=video " << ntohs(saddr_.sin_port) << " RTP/AVP " << (int)payload_type << "\r\n";
+	if (h264_)
+	{
+		sdp << "a=rtpmap:96 H264/90000\r\n"
+			<< "a=fmtp:96 packetization-mode=1";
+		if (sps_.size() >= 4 && !pps_.empty())
+		{
+			char profile_level_id[8];
+			snprintf(profile_level_id, sizeof(profile_level_id), "%02x%02x%02x", sps_[1], sps_[2], sps_[3]);
+			sdp << ";profile-level-id=" << profile_level_id << ";sprop-parameter-sets=" << base64(sps_) << ","
+				<< base64(pps_);
+		}
+		sdp << "\r\n";
+	}
+	else
+		sdp << "a=rtpmap:26 JPEG/90000\r\n";
+	if (options_->framerate > 0)
+		sdp << "a=framerate:" << options_->framerate << "\r\n";
+	return sdp.str();
+}
+
+void RtpOutput::writeSdp()
+{
+	std::string description = sdp();
+	if (!options_->sdp.empty())
+	{
+		std::ofstream out(options_->sdp);
+		if (!out)
+			throw std::runtime_error("failed to open sdp file " + options_->sdp);
+		out << description;
+	}
+	if (options_->verbose)
+		std::cerr << "RtpOutput: SDP" << std::endl << description;
+}
+
+uint8_t *RtpOutput::newPacket(uint32_t timestamp)
+{
+	packets_.emplace_back();
+	uint8_t *h = packets_.back().headers;
+	h[0] = 0x80; // version 2
+	h[1] = h264_ ? PAYLOAD_TYPE_H264 : PAYLOAD_TYPE_JPEG;
+	h[2] = sequence_ >> 8;
+	h[3] = sequence_;
+	h[4] = timestamp >> 24;
+	h[5] = timestamp >> 16;
+	h[6] = timestamp >> 8;
+	h[7] = timestamp;
+	h[8] = ssrc_ >> 24;
+	h[9] = ssrc_ >> 16;
+	h[10] = ssrc_ >> 8;
+	h[11] = ssrc_;
+	sequence_++;
+	return h + RTP_HEADER_SIZE;
+}
+
+void RtpOutput::packetiseJpeg(uint8_t const *jpeg, size_t size, uint32_t timestamp)
+{
+	// Find what RFC 2435 needs from the JPEG headers, and where the scan data starts. It only
+	// covers baseline JPEGs with the standard Huffman tables, as libjpeg makes by default.
+	if (size < 4 || jpeg[0] != 0xff || jpeg[1] != 0xd8)
+		throw std::runtime_error("not a JPEG");
+	uint8_t const *qtables[2] = {};
+	unsigned int width = 0, height = 0, restart_interval = 0;
+	int type = -1;
+	size_t pos = 2, scan = 0;
+	while (!scan)
+	{
+		if (pos + 4 > size || jpeg[pos] != 0xff)
+			throw std::runtime_error("bad JPEG headers");
+		uint8_t marker = jpeg[pos + 1];
+		size_t length = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+		uint8_t const *segment = jpeg + pos + 4;
+		if (length < 2 || pos + 2 + length > size)
+			throw std::runtime_error("bad JPEG headers");
+
+		if (marker == 0xdb) // DQT
+		{
+			for (size_t i = 0; i + 65 <= length - 2; i += 65)
+			{
+				if (segment[i] >> 4)
+					throw std::runtime_error("16 bit JPEG quantisation tables not supported");
+				if ((segment[i] & 15) < 2)
+					qtables[segment[i] & 15] = segment + i + 1;
+			}
+		}
+		else if (marker == 0xc0) // SOF0
+		{
+			height = (segment[1] << 8) | segment[2];
+			width = (segment[3] << 8) | segment[4];
+			// Types 0 and 1 are YUV 4:2:2 and 4:2:0, with the luma table for Y only.
+			bool tables_ok = segment[5] == 3 && segment[8] == 0 && segment[9 + 2] == 1 && segment[12 + 2] == 1 &&
+							 segment[9 + 1] == 0x11 && segment[12 + 1] == 0x11;
+			if (tables_ok && segment[7] == 0x21)
+				type = 0;
+			else if (tables_ok && segment[7] == 0x22)
+				type = 1;
+		}
+		else if (marker == 0xdd) // DRI
+			restart_interval = (segment[0] << 8) | segment[1];
+		else if (marker == 0xda) // SOS
+			scan = pos + 2 + length;
+		else if (marker != 0xc4 && (marker < 0xe0 || marker > 0xef) && marker != 0xfe)
+			throw std::runtime_error("unsupported JPEG marker");
+		pos += 2 + length;
+	}
+	if (type < 0 || !qtables[0] || !qtables[1])
+		throw std::runtime_error("JPEG not type 0 or 1 as RFC 2435 needs");
+	if (width > 2040 || height > 2040)
+		throw std::runtime_error("JPEG too big for RFC 2435");
+	size_t scan_end = size;
+	if (jpeg[size - 2] == 0xff && jpeg[size - 1] == 0xd9)
+		scan_end -= 2;
+
+	for (size_t offset = scan; offset < scan_end;)
+	{
+		uint8_t *h = newPacket(timestamp);
+		size_t data_offset = offset - scan;
+		h[0] = 0;
+		h[1] = data_offset >> 16;
+		h[2] = data_offset >> 8;
+		h[3] = data_offset;
+		h[4] = type + (restart_interval ? 64 : 0);
+		h[5] = 255; // tables in-band
+		h[6] = (width + 7) / 8;
+		h[7] = (height + 7) / 8;
+		h += JPEG_HEADER_SIZE;
+		if (restart_interval)
+		{
+			// Packets don't line up with restart intervals, which F, L and the count all say.
+			h[0] = restart_interval >> 8;
+			h[1] = restart_interval;
+			h[2] = 0xff;
+			h[3] = 0xff;
+			h += RESTART_HEADER_SIZE;
+		}
+		if (data_offset == 0)
+		{
+			h[0] = 0;
+			h[1] = 0; // both tables 8 bit
+			h[2] = 0;
+			h[3] = 128;
+			memcpy(h + 4, qtables[0], 64);
+			memcpy(h + 4 + 64, qtables[1], 64);
+			h += QUANT_HEADER_SIZE;
+		}
+
+		Packet &packet = packets_.back();
+		packet.headers_size = h - packet.headers;
+		packet.payload = jpeg + offset;
+		packet.payload_size = std::min(options_->rtp_mtu - packet.headers_size, scan_end - offset);
+		offset += packet.payload_size;
+	}
+}
+
+void RtpOutput::packetiseH264(uint8_t const *data, size_t size, uint32_t timestamp)
+{
+	// Split the Annex B stream into NAL units at its start codes.
+	std::vector<std::pair<uint8_t const *, size_t>> nals;
+	size_t start = 0;
+	for (size_t i = 0; i + 3 <= size; i++)
+	{
+		if (data[i] || data[i + 1] || data[i + 2] != 1)
+			continue;
+		size_t end = i > start && !data[i - 1] ? i - 1 : i;
+		if (start && end > start)
+			nals.emplace_back(data + start, end - start);
+		start = i + 3;
+		i += 2;
+	}
+	if (start && start < size)
+		nals.emplace_back(data + start, size - start);
+
+	// Keep the latest parameter sets, and put them in front of an IDR frame that came without.
+	bool sps = false, pps = false, idr = false, changed = false;
+	for (auto [nal, length] : nals)
+	{
+		uint8_t type = nal[0] & 0x1f;
+		std::vector<uint8_t> *parameters = type == NAL_SPS ? &sps_ : type == NAL_PPS ? &pps_ : nullptr;
+		if (parameters && !std::equal(nal, nal + length, parameters->begin(), parameters->end()))
+		{
+			parameters->assign(nal, nal + length);
+			changed = true;
+		}
+		sps |= type == NAL_SPS;
+		pps |= type == NAL_PPS;
+		idr |= type == NAL_IDR;
+	}
+	if (changed)
+		writeSdp();
+	if (idr && !pps && !pps_.empty())
+		nals.insert(nals.begin(), { pps_.data(), pps_.size() });
+	if (idr && !sps && !sps_.empty())
+		nals.insert(nals.begin(), { sps_.data(), sps_.size() });
+
+	for (auto [nal, length] : nals)
+	{
+		if (RTP_HEADER_SIZE + length <= options_->rtp_mtu)
+		{
+			newPacket(timestamp);
+			Packet &packet = packets_.back();
+			packet.headers_size = RTP_HEADER_SIZE;
+			packet.payload = nal;
+			packet.payload_size = length;
+			continue;
+		}
+
+		// Too big for one packet, so FU-A fragments, which carry the NAL header themselves.
+		size_t max_payload = options_->rtp_mtu - RTP_HEADER_SIZE - FU_A_HEADER_SIZE;
+		for (size_t pos = 1; pos < length;)
+		{
+			uint8_t *h = newPacket(timestamp);
+			size_t payload_size = std::min(max_payload, length - pos);
+			h[0] = (nal[0] & 0xe0) | 28;
+			h[1] = (pos == 1 ? 0x80 : 0) | (pos + payload_size == length ? 0x40 : 0) | (nal[0] & 0x1f);
+			Packet &packet = packets_.back();
+			packet.headers_size = RTP_HEADER_SIZE + FU_A_HEADER_SIZE;
+			packet.payload = nal + pos;
+			packet.payload_size = payload_size;
+			pos += payload_size;
+		}
+	}
+}
+
+void RtpOutput::sendPackets(int64_t timestamp_us, bool pace)
+{
+	size_t n = packets_.size();
+	msgs_.resize(n);
+	iovs_.resize(2 * n);
+	for (size_t i = 0; i < n; i++)
+	{
+		iovs_[2 * i] = { packets_[i].headers, packets_[i].headers_size };
+		iovs_[2 * i + 1] = { const_cast<uint8_t *>(packets_[i].payload), packets_[i].payload_size };
+		msgs_[i] = {};
+		msgs_[i].msg_hdr.msg_name = &saddr_;
+		msgs_[i].msg_hdr.msg_namelen = sizeof(saddr_);
+		msgs_[i].msg_hdr.msg_iov = &iovs_[2 * i];
+		msgs_[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	// Spread the bursts over the requested part of the frame interval.
+	int64_t interval_us = options_->framerate > 0 ? 1000000 / options_->framerate : timestamp_us - last_timestamp_us_;
+	last_timestamp_us_ = timestamp_us;
+	size_t bursts = (n + BURST - 1) / BURST;
+	auto gap = std::chrono::microseconds(pace && bursts > 1 && interval_us > 0 && interval_us < 1000000
+											 ? interval_us * options_->rtp_pace / 100 / bursts
+											 : 0);
+
+	auto next = std::chrono::steady_clock::now();
+	for (size_t sent = 0; sent < n;)
+	{
+		if (sent % BURST == 0 && sent)
+		{
+			next += gap;
+			std::this_thread::sleep_until(next);
+		}
+		size_t burst_end = std::min(n, (sent / BURST + 1) * BURST);
+		int ret = sendmmsg(fd_, &msgs_[sent], burst_end - sent, 0);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("failed to send rtp packets");
+		}
+		sent += ret;
+	}
+}
+
+void RtpOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// The sender thread works from a copy, as the encoder wants its buffer straight back.
+	Frame frame;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		// Missing an H.264 frame spoils the ones after it, so then we wait for a keyframe.
+		if (queue_.size() >= MAX_QUEUED || (waiting_keyframe_ && !(flags & FLAG_KEYFRAME)))
+		{
+			frames_skipped_++;
+			waiting_keyframe_ = h264_;
+			return;
+		}
+		waiting_keyframe_ = false;
+		if (!spare_.empty())
+		{
+			frame = std::move(spare_.back());
+			spare_.pop_back();
+		}
+	}
+
+	uint8_t *data = (uint8_t *)mem;
+	frame.data.assign(data, data + size);
+	frame.timestamp_us = timestamp_us;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.push_back(std::move(frame));
+	}
+	cond_.notify_one();
+}
+
+void RtpOutput::senderThread()
+{
+	while (true)
+	{
+		Frame frame;
+		bool pace;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			if (queue_.empty())
+				return;
+			frame = std::move(queue_.front());
+			queue_.pop_front();
+			// With frames backing up, or on our way out, we send as fast as we can.
+			pace = !abort_ && queue_.empty();
+		}
+
+		uint32_t timestamp = timestamp_offset_ + static_cast<uint32_t>(frame.timestamp_us * 9 / 100);
+		packets_.clear();
+		try
+		{
+			if (h264_)
+				packetiseH264(frame.data.data(), frame.data.size(), timestamp);
+			else
+				packetiseJpeg(frame.data.data(), frame.data.size(), timestamp);
+			if (!packets_.empty())
+			{
+				packets_.back().headers[1] |= 0x80; // marker on the frame's last packet
+				sendPackets(frame.timestamp_us, pace);
+			}
+		}
+		catch (std::exception const &e)
+		{
+			// A bad frame, or a network hiccup, is no reason to stop sending.
+			frames_skipped_++;
+			if (options_->verbose)
+				std::cerr << "RtpOutput: skipping frame: " << e.what() << std::endl;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		spare_.push_back(std::move(frame));
+	}
+}
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * rtp_output.hpp - send output as RTP over UDP.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// An rtp://a.b.c.d:port output packetises MJPEG as in RFC 2435 (payload type 26, with the
+// quantisation tables taken from each JPEG and sent in-band) or H.264 as in RFC 6184
+// (payload type 96, with FU-A fragments for NAL units too big for one packet). RTP
+// timestamps are the sensor timestamps on the 90kHz clock. Each frame's packets go out in
+// small bursts spread over --rtp-pace percent of the frame interval, rather than all at
+// once. That happens on our own thread, working from a copy of the frame, so pacing never
+// holds up the encoder. The latest H.264 SPS and PPS go ahead of every IDR frame that lacks
+// them, and into the SDP description for players, which is written to --sdp (again whenever
+// they change), and shown with --verbose.
+class RtpOutput : public Output
+{
+public:
+	RtpOutput(VideoOptions const *options);
+	~RtpOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	static constexpr size_t RTP_HEADER_SIZE = 12;
+	// Room for all the headers in front of a packet's payload.
+	static constexpr size_t MAX_HEADERS_SIZE = 160;
+
+	struct Packet
+	{
+		uint8_t headers[MAX_HEADERS_SIZE];
+		size_t headers_size;
+		uint8_t const *payload;
+		size_t payload_size;
+	};
+
+	// Start a packet with its RTP header, returning where the next header goes.
+	uint8_t *newPacket(uint32_t timestamp);
+	void packetiseJpeg(uint8_t const *jpeg, size_t size, uint32_t timestamp);
+	void packetiseH264(uint8_t const *data, size_t size, uint32_t timestamp);
+	void sendPackets(int64_t timestamp_us, bool pace);
+	std::string sdp() const;
+	void writeSdp();
+	void senderThread();
+
+	int fd_;
+	sockaddr_in saddr_;
+	bool h264_;
+	uint32_t ssrc_;
+	uint16_t sequence_;
+	uint32_t timestamp_offset_;
+	int64_t last_timestamp_us_;
+	std::vector<uint8_t> sps_;
+	std::vector<uint8_t> pps_;
+	std::vector<Packet> packets_; // kept from frame to frame, like what follows
+	std::vector<mmsghdr> msgs_;
+	std::vector<iovec> iovs_;
+	std::atomic<unsigned int> frames_skipped_; // that couldn't be packetised, or sent in time
+
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+		int64_t timestamp_us;
+	};
+	std::deque<Frame> queue_; // waiting for the sender thread
+	std::vector<Frame> spare_; // whose buffers we can use again
+	bool waiting_keyframe_; // after skipping an H.264 frame
+	bool abort_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::thread sender_thread_;
+};
@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * shm_output.cpp - publish frames through a shared memory ring.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include "shm_output.hpp"
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring atomics must work across processes");
+static_assert(sizeof(ShmSlotHeader) <= ShmOutput::SLOT_HEADER_SIZE, "slot header too big");
+
+constexpr size_t PAGE_SIZE = 4096;
+
+static size_t page_align(size_t size)
+{
+	return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+ShmOutput::ShmOutput(VideoOptions const *options)
+	: Output(options), ring_(nullptr), num_slots_(options->shm_slots), sequence_(0), frames_skipped_(0)
+{
+	std::string path = options->output.substr(6);
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("shm socket path too long: " + path);
+	strcpy(addr.sun_path, path.c_str());
+
+	size_t max_frame = options->shm_slot_size ? static_cast<size_t>(options->shm_slot_size) << 10
+											  : static_cast<size_t>(options->width) * options->height * 2;
+	slot_size_ = page_align(SLOT_HEADER_SIZE + max_frame);
+	data_offset_ = page_align(sizeof(ShmRingHeader));
+	ring_size_ = data_offset_ + static_cast<size_t>(slot_size_) * num_slots_;
+
+	memfd_ = memfd_create("libcamera-bridge-ring", MFD_CLOEXEC);
+	if (memfd_ < 0)
+		throw std::runtime_error("unable to create shm ring");
+	if (ftruncate(memfd_, ring_size_) < 0)
+		throw std::runtime_error("unable to size shm ring");
+	void *ring = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, memfd_, 0);
+	if (ring == MAP_FAILED)
+		throw std::runtime_error("unable to map shm ring");
+	ring_ = static_cast<uint8_t *>(ring);
+
+	// The memfd starts zeroed, so every slot's sequence already says "never written".
+	ShmRingHeader *header = new (ring_) ShmRingHeader;
+	memcpy(header->magic, "CRSH", 4);
+	header->version = VERSION;
+	header->num_slots = num_slots_;
+	header->slot_size = slot_size_;
+	header->data_offset = data_offset_;
+	header->published.store(0, std::memory_order_release);
+
+	eventfd_ = eventfd(0, EFD_CLOEXEC);
+	if (eventfd_ < 0)
+		throw std::runtime_error("unable to create shm eventfd");
+
+	socket_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (socket_fd_ < 0)
+		throw std::runtime_error("unable to open unix socket");
+	if (connect(socket_fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		throw std::runtime_error("unable to connect to unix socket " + path);
+
+	ShmSetup setup = {};
+	memcpy(setup.magic, "CRSH", 4);
+	setup.version = VERSION;
+	setup.num_slots = num_slots_;
+	setup.slot_size = slot_size_;
+	setup.data_offset = data_offset_;
+	setup.memfd_size = ring_size_;
+
+	int fds[2] = { memfd_, eventfd_ };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(fds))];
+		cmsghdr align;
+	} control = {};
+	iovec iov = { &setup, sizeof(setup) };
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(socket_fd_, &msg, MSG_NOSIGNAL) != sizeof(setup))
+		throw std::runtime_error("unable to send shm ring to consumer");
+
+	if (options->verbose)
+		std::cerr << "ShmOutput: " << num_slots_ << " slots of " << slot_size_ << " bytes shared with " << path
+				  << std::endl;
+}
+
+ShmOutput::~ShmOutput()
+{
+	if (options_->verbose && frames_skipped_)
+		std::cerr << "ShmOutput: skipped " << frames_skipped_ << " frames too big for a slot" << std::endl;
+	munmap(ring_, ring_size_);
+	close(eventfd_);
+	close(memfd_);
+	close(socket_fd_);
+}
+
+void ShmOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	if (size > slot_size_ - SLOT_HEADER_SIZE)
+	{
+		frames_skipped_++;
+		if (options_->verbose)
+			std::cerr << "ShmOutput: " << size << " byte frame too big for a slot" << std::endl;
+		return;
+	}
+
+	uint64_t n = sequence_++;
+	uint8_t *slot = ring_ + data_offset_ + (n % num_slots_) * slot_size_;
+	ShmSlotHeader *header = reinterpret_cast<ShmSlotHeader *>(slot);
+
+	// Mark the slot as being written before touching anything else in it.
+	header->sequence.store(2 * n + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	header->timestamp_us = timestamp_us;
+	header->length = size;
+	header->flags = flags;
+	memcpy(slot + SLOT_HEADER_SIZE, mem, size);
+	header->sequence.store(2 * n + 2, std::memory_order_release);
+
+	reinterpret_cast<ShmRingHeader *>(ring_)->published.store(n + 1, std::memory_order_release);
+	uint64_t one = 1;
+	if (write(eventfd_, &one, sizeof(one)) < 0)
+		throw std::runtime_error("failed to signal shm consumer");
+}
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * shm_output.hpp - publish frames through a shared memory ring.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "output.hpp"
+
+// An shm:///path/to/socket output connects to a consumer listening on a unix socket, as
+// for sck://, but sends it just one message: a ShmSetup, with the ring's memfd and an
+// eventfd attached (in that order) as SCM_RIGHTS. Frames then go into the ring, and the
+// eventfd is signalled after each one, so the consumer can read them where they are.
+//
+// The ring starts with a ShmRingHeader, and slot n % num_slots, at data_offset +
+// (n % num_slots) * slot_size, holds frame n. Each slot starts with a ShmSlotHeader and the
+// frame follows at offset SLOT_HEADER_SIZE. We never wait for the consumer, which sees
+// that it fell behind when a slot's sequence is past the frame it wanted. A slot's sequence
+// is odd while it is being written; the frame is only good if the sequence, read before and
+// after using it, is the same even number.
+struct ShmSetup
+{
+	char magic[4]; // "CRSH"
+	uint32_t version;
+	uint32_t num_slots;
+	uint32_t slot_size; // bytes from one slot to the next
+	uint32_t data_offset; // of slot 0
+	uint32_t memfd_size;
+};
+
+struct ShmRingHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t num_slots;
+	uint32_t slot_size;
+	uint32_t data_offset;
+	uint32_t reserved;
+	std::atomic<uint64_t> published; // frames written so far
+};
+
+struct ShmSlotHeader
+{
+	std::atomic<uint64_t> sequence; // 2n + 1 while frame n is written, 2n + 2 once it's done
+	int64_t timestamp_us;
+	uint32_t length;
+	uint32_t flags; // 1 for a keyframe, 2 where recording restarts
+};
+
+class ShmOutput : public Output
+{
+public:
+	static constexpr uint32_t VERSION = 1;
+	static constexpr uint32_t SLOT_HEADER_SIZE = 64;
+
+	ShmOutput(VideoOptions const *options);
+	~ShmOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	int socket_fd_;
+	int memfd_;
+	int eventfd_;
+	uint8_t *ring_;
+	size_t ring_size_;
+	uint32_t num_slots_;
+	uint32_t slot_size_;
+	uint32_t data_offset_;
+	uint64_t sequence_;
+	unsigned int frames_skipped_; // too big for a slot
+};
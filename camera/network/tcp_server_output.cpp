@@ -0,0 +1,298 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * tcp_server_output.cpp - serve output to any number of tcp clients.
+ */
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include "tcp_server_output.hpp"
+
+// Most frames we hand to the kernel in one go.
+constexpr unsigned int MAX_IOVS = 16;
+// Longest a client may go on about itself before we give up on it.
+constexpr size_t MAX_REQUEST = 4096;
+
+static const char EOL[] = { '\r', '\n' };
+
+TcpServerOutput::TcpServerOutput(VideoOptions const *options) : Output(options), abort_(false)
+{
+	int a, b, c, d, port;
+	if (sscanf(options->output.c_str(), "%*[a-z]://%d.%d.%d.%d:%d", &a, &b, &c, &d, &port) != 5)
+		throw std::runtime_error("bad network address " + options->output);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+	// So that a restarted stream can listen again straight away.
+	int one = 1;
+	setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	sockaddr_in server_saddr = {};
+	server_saddr.sin_family = AF_INET;
+	server_saddr.sin_addr.s_addr = INADDR_ANY;
+	server_saddr.sin_port = htons(port);
+	if (bind(listen_fd_, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
+	{
+		close(listen_fd_);
+		throw std::runtime_error("failed to bind listen socket");
+	}
+	listen(listen_fd_, 8);
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("unable to create tcp server events");
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = listen_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event);
+	event.data.fd = event_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event);
+
+	if (options->verbose)
+		std::cerr << "TcpServerOutput: listening on port " << port << std::endl;
+}
+
+TcpServerOutput::~TcpServerOutput()
+{
+	stop();
+	while (!clients_.empty())
+		closeClient(clients_.begin()->first);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+void TcpServerOutput::stop()
+{
+	if (!server_thread_.joinable())
+		return;
+	abort_ = true;
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
+	server_thread_.join();
+}
+
+TcpServerOutput::Frame TcpServerOutput::makeFrame(void *mem, size_t size)
+{
+	char header[32];
+	int header_length = snprintf(header, sizeof(header), "PUB frame.jpeg %lu\r\n", static_cast<unsigned long>(size));
+	Frame frame = std::make_shared<std::vector<uint8_t>>(header_length + size + 2);
+	uint8_t *p = frame->data();
+	memcpy(p, header, header_length);
+	memcpy(p + header_length, mem, size);
+	memcpy(p + header_length + size, EOL, 2);
+	return frame;
+}
+
+void TcpServerOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// Clients connecting before now wait in the listen queue, as the server thread only starts
+	// once any derived class is completely built.
+	if (!server_thread_.joinable())
+		server_thread_ = std::thread(&TcpServerOutput::serverThread, this);
+
+	// Clients that need this frame all send the same copy.
+	Frame frame;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto &[fd, client] : clients_)
+		{
+			if (!client.streaming || client.closing)
+				continue;
+			if (client.waiting_keyframe)
+			{
+				if (!(flags & FLAG_KEYFRAME))
+					continue;
+				client.waiting_keyframe = false;
+			}
+			// Frames come with some jitter, so a rate cap lets them through a little early.
+			else if (client.min_interval_us &&
+					 timestamp_us - client.last_timestamp_us < client.min_interval_us * 7 / 8)
+				continue;
+			// A slow client skips whole frames, never part of one it has started, and then
+			// waits for a keyframe, as the frames after a skipped one may depend on it.
+			if (client.queue.size() >= options_->client_queue)
+			{
+				client.frames_skipped++;
+				client.waiting_keyframe = true;
+				continue;
+			}
+			if (!frame)
+				frame = makeFrame(mem, size);
+			client.queue.push_back(frame);
+			client.last_timestamp_us = timestamp_us;
+		}
+	}
+
+	if (frame)
+	{
+		uint64_t one = 1;
+		[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
+	}
+}
+
+void TcpServerOutput::serverThread()
+{
+	epoll_event events[16];
+	while (!abort_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			std::cerr << "ERROR: TcpServerOutput: epoll_wait failed: " << strerror(errno) << std::endl;
+			return;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == event_fd_)
+			{
+				// New frames for (potentially) everyone.
+				uint64_t count;
+				[[maybe_unused]] ssize_t ret = read(event_fd_, &count, sizeof(count));
+				std::lock_guard<std::mutex> lock(mutex_);
+				std::vector<int> gone;
+				for (auto &[client_fd, client] : clients_)
+				{
+					if (!sendFrames(client_fd, client))
+						gone.push_back(client_fd);
+				}
+				for (int client_fd : gone)
+					closeClient(client_fd);
+			}
+			else
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				auto it = clients_.find(fd);
+				if (it == clients_.end())
+					continue;
+				bool ok = !(events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP));
+				if (ok && (events[i].events & EPOLLIN))
+					ok = readInput(fd, it->second);
+				if (ok && (events[i].events & EPOLLOUT))
+					ok = sendFrames(fd, it->second);
+				if (!ok)
+					closeClient(fd);
+			}
+		}
+	}
+}
+
+void TcpServerOutput::acceptClients()
+{
+	while (true)
+	{
+		sockaddr_in addr;
+		socklen_t addr_len = sizeof(addr);
+		int fd = accept4(listen_fd_, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && options_->verbose)
+				std::cerr << "TcpServerOutput: accept failed: " << strerror(errno) << std::endl;
+			return;
+		}
+		if (options_->sndbuf)
+		{
+			int sndbuf = options_->sndbuf;
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+		}
+
+		// Edge triggered, so we hear when a full socket has room again.
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			close(fd);
+			continue;
+		}
+
+		std::string name = std::string(inet_ntoa(addr.sin_addr)) + ":" + std::to_string(ntohs(addr.sin_port));
+		if (options_->verbose)
+			std::cerr << "TcpServerOutput: client " << name << " connected" << std::endl;
+		std::lock_guard<std::mutex> lock(mutex_);
+		Client &client = clients_[fd] = { name, {}, {}, 0, false, false, true, 0, 0, 0, 0 };
+		clientConnected(client);
+	}
+}
+
+bool TcpServerOutput::sendFrames(int fd, Client &client)
+{
+	while (!client.queue.empty())
+	{
+		iovec iov[MAX_IOVS];
+		unsigned int iovs = 0;
+		for (auto it = client.queue.begin(); it != client.queue.end() && iovs < MAX_IOVS; it++, iovs++)
+		{
+			size_t offset = iovs ? 0 : client.offset;
+			iov[iovs] = { (*it)->data() + offset, (*it)->size() - offset };
+		}
+
+		msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovs;
+		ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+		// Let go of every frame that's now completely sent.
+		size_t sent = ret;
+		while (!client.queue.empty() && sent >= client.queue.front()->size() - client.offset)
+		{
+			sent -= client.queue.front()->size() - client.offset;
+			client.queue.pop_front();
+			client.offset = 0;
+			client.frames_sent++;
+		}
+		client.offset += sent;
+	}
+	return !client.closing;
+}
+
+bool TcpServerOutput::readInput(int fd, Client &client)
+{
+	char buf[1024];
+	while (true)
+	{
+		ssize_t ret = read(fd, buf, sizeof(buf));
+		if (ret > 0)
+		{
+			if (!clientInput(client, buf, ret) || client.request.size() > MAX_REQUEST)
+				return false;
+			continue;
+		}
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return sendFrames(fd, client); // for anything we've just been asked for
+		if (ret < 0 && errno == EINTR)
+			continue;
+		return false;
+	}
+}
+
+void TcpServerOutput::closeClient(int fd)
+{
+	auto it = clients_.find(fd);
+	if (options_->verbose)
+		std::cerr << "TcpServerOutput: client " << it->second.name << " gone, sent " << it->second.frames_sent
+				  << " frames, skipped " << it->second.frames_skipped << std::endl;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients_.erase(it);
+}
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2022, Capable Robot Components, Inc.
+ *
+ * tcp_server_output.hpp - serve output to any number of tcp clients.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// With --listen, a tcp://a.b.c.d:port output accepts clients on that port for as long as it
+// runs, and sends each of them the frames (in the same PUB framing as a tcp:// client) from
+// the next keyframe after it connects. Each frame is copied once and shared between all the
+// clients sending it. A client gets at most --client-queue frames queued, and skips frames
+// beyond that, but only ever whole ones. The sockets are all non-blocking and looked after
+// by a thread of our own, so the encoder never waits on a client.
+class TcpServerOutput : public Output
+{
+public:
+	TcpServerOutput(VideoOptions const *options);
+	~TcpServerOutput();
+
+protected:
+	typedef std::shared_ptr<std::vector<uint8_t>> Frame;
+
+	struct Client
+	{
+		std::string name;
+		std::string request; // what the client has said, for derived classes to keep
+		std::deque<Frame> queue;
+		size_t offset; // of what's been sent from the front frame
+		bool streaming; // whether to queue frames for it
+		bool closing; // once the queue is sent
+		bool waiting_keyframe;
+		int64_t min_interval_us; // between frames, for a client with a frame rate cap
+		int64_t last_timestamp_us;
+		unsigned int frames_sent;
+		unsigned int frames_skipped;
+	};
+
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+	// The bytes to send for a frame, in whatever framing the clients expect.
+	virtual Frame makeFrame(void *mem, size_t size);
+	// Plain tcp clients stream from the start, and have nothing to say. Derived classes can
+	// wait to hear from a client first, and queue anything they want to send it, returning
+	// false to drop the client.
+	virtual void clientConnected(Client &client) { client.streaming = true; }
+	virtual bool clientInput(Client &client, char const *data, size_t size) { return true; }
+	// Derived classes must stop the server thread before they go, as it calls them.
+	void stop();
+
+private:
+	void serverThread();
+	void acceptClients();
+	// Send as much as the client's socket will take, returning false if the client's gone.
+	bool sendFrames(int fd, Client &client);
+	bool readInput(int fd, Client &client);
+	void closeClient(int fd);
+
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_; // to wake the server thread
+	std::map<int, Client> clients_; // by fd
+	std::mutex mutex_;
+	std::atomic<bool> abort_;
+	std::thread server_thread_;
+};
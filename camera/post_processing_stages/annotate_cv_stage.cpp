@@ -80,7 +80,7 @@ void AnnotateCvStage::Configure()
 
 bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
 {
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[stream_])[0];
  	FrameInfo info(completed_request->metadata);
  	info.sequence = completed_request->sequence;
 
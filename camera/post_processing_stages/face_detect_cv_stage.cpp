@@ -120,7 +120,7 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 		if (completed_request->sequence % refresh_rate_ == 0 &&
 			(!future_ptr_ || future_ptr_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+			libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[stream_])[0];
 			uint8_t *ptr = (uint8_t *)buffer.data();
 			Mat image(height_, width_, CV_8U, ptr, stride_);
 			image_ = image.clone();
@@ -139,7 +139,7 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 
 	if (draw_features_)
 	{
-		libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[full_stream_])[0];
+		libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[full_stream_])[0];
 		uint8_t *ptr = (uint8_t *)buffer.data();
 		Mat image(full_height_, full_width_, CV_8U, ptr, full_stride_);
 		drawFeatures(image);
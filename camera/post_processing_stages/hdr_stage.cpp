@@ -467,7 +467,7 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 	if (frame_num_ >= config_.num_frames)
 		return false;
 
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[stream_])[0];
 	uint8_t *image = buffer.data();
 
 	// Accumulate frame.
@@ -133,7 +133,7 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 	if (config_.frame_period && completed_request->sequence % config_.frame_period)
 		return false;
 
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[stream_])[0];
 	uint8_t *image = buffer.data();
 
 	// We need to protect access to first_time_, previous_frame_ and motion_detected_.
@@ -44,7 +44,7 @@ void NegateStage::Configure()
 
 bool NegateStage::Process(CompletedRequestPtr &completed_request)
 {
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[stream_])[0];
 	uint32_t *ptr = (uint32_t *)buffer.data();
 
 	// Constraints on the stride mean we always have multiple-of-4 bytes.
@@ -124,16 +124,12 @@ void ObjectDetectTfStage::interpretOutputs()
 		int x = std::clamp<int>(WIDTH * boxes[i * 4 + 1], 0, WIDTH);
 		int h = std::clamp<int>(HEIGHT * boxes[i * 4 + 2] - y, 0, HEIGHT);
 		int w = std::clamp<int>(WIDTH * boxes[i * 4 + 3] - x, 0, WIDTH);
-		// The network is fed a crop from the lores (if that was too large), so the coords
-		// in the full lores image are:
-		y += (lores_h_ - HEIGHT) / 2;
-		x += (lores_w_ - WIDTH) / 2;
-		// The lores is a pure scaling of the main image (squishing if the aspect ratios
-		// don't match), so:
-		y = y * main_h_ / lores_h_;
-		x = x * main_w_ / lores_w_;
-		h = h * main_h_ / lores_h_;
-		w = w * main_w_ / lores_w_;
+		// The network is fed the whole lores image scaled to its input size, and the lores
+		// is a pure scaling of the main image (squishing if the aspect ratios don't match), so:
+		y = y * main_h_ / HEIGHT;
+		x = x * main_w_ / WIDTH;
+		h = h * main_h_ / HEIGHT;
+		w = w * main_w_ / WIDTH;
 
 		int c = classes[i];
 		Detection detection(c, labels_[c], scores[i], x, y, w, h);
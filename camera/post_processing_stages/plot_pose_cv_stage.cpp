@@ -91,7 +91,7 @@ bool PlotPoseCvStage::Process(CompletedRequestPtr &completed_request)
 		return false;
 
 	unsigned int w, h, stride;
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[stream_])[0];
 	uint32_t *ptr = (uint32_t *)buffer.data();
 	app_->StreamDimensions(stream_, &w, &h, &stride);
 
@@ -5,6 +5,14 @@
  * post_processing_stage.cpp - Post processing stage base class implementation.
  */
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+
 #include "post_processing_stage.hpp"
 
 PostProcessingStage::PostProcessingStage(LibcameraApp *app) : app_(app)
@@ -41,207 +49,216 @@ void PostProcessingStage::Teardown()
 {
 }
 
-std::vector<uint8_t> PostProcessingStage::Yuv420ToRgb(const uint8_t *src, int src_w, int src_h, int src_stride,
-													  int dst_w, int dst_h, int dst_stride)
+namespace
 {
-	std::vector<uint8_t> output(dst_h * dst_stride);
 
-	assert(src_w >= dst_w && src_h >= dst_h);
-	int off_x = ((src_w - dst_w) / 2) & ~1, off_y = ((src_h - dst_h) / 2) & ~1;
-	int src_Y_size = src_h * src_stride, src_U_size = (src_h / 2) * (src_stride / 2);
+// Bilinear weights are in Q7, so that the weights, and weighted sums of two 8-bit
+// samples, fit in the narrow SIMD lanes.
+constexpr int WEIGHT_BITS = 7;
+constexpr int WEIGHT_ONE = 1 << WEIGHT_BITS;
+
+// Full range BT.601 coefficients in Q6: R = Y + 1.402 V, G = Y - 0.345 U - 0.714 V and
+// B = Y + 1.771 U. Every intermediate value fits in 16 bits.
+constexpr int COEFF_BITS = 6;
+constexpr int16_t R_V = 90, G_U = 22, G_V = 46, B_U = 113;
+
+// Output sample i blends input samples index and index + 1, the second with this weight.
+struct Tap
+{
+	int index;
+	int weight;
+};
+
+Tap makeTap(int i, int src_size, int dst_size)
+{
+	// Line up the pixel centres, so that the whole of the source maps onto the destination.
+	int64_t pos = ((2 * i + 1) * (int64_t)src_size * WEIGHT_ONE) / (2 * dst_size) - WEIGHT_ONE / 2;
+	pos = std::max<int64_t>(pos, 0);
+	int index = pos >> WEIGHT_BITS;
+	if (index < src_size - 1)
+		return { index, (int)(pos & (WEIGHT_ONE - 1)) };
+	// Never read past the final sample.
+	return src_size > 1 ? Tap { src_size - 2, WEIGHT_ONE } : Tap { 0, 0 };
+}
+
+void makeTaps(std::vector<Tap> &taps, int src_size, int dst_size)
+{
+	taps.resize(dst_size);
+	for (int i = 0; i < dst_size; i++)
+		taps[i] = makeTap(i, src_size, dst_size);
+}
 
-	// We're going to process 4x2 pixel blocks, as far as alignment allows.
-	int dst_h_aligned = dst_h & ~1, dst_w_aligned = dst_w & ~3;
+// Blend two rows vertically, returning row0 itself if it needs no blending.
+const uint8_t *blendRows(uint8_t *dst, const uint8_t *row0, const uint8_t *row1, int weight, int width)
+{
+	if (weight == 0)
+		return row0;
+	if (weight == WEIGHT_ONE)
+		return row1;
 
-	int y = 0;
-	for (; y < dst_h_aligned; y += 2)
+	int x = 0;
+#if defined(__ARM_NEON)
+	uint8x8_t w0 = vdup_n_u8(WEIGHT_ONE - weight), w1 = vdup_n_u8(weight);
+	for (; x + 16 <= width; x += 16)
 	{
-		const uint8_t *src_Y0 = src + (y + off_y) * src_stride + off_x;
-		const uint8_t *src_U = src + src_Y_size + ((y + off_y) / 2) * (src_stride / 2) + off_x / 2;
-		const uint8_t *src_V = src_U + src_U_size;
-		const uint8_t *src_Y1 = src_Y0 + src_stride;
-		uint8_t *dst0 = &output[y * dst_stride];
-		uint8_t *dst1 = dst0 + dst_stride;
-
-		int x = 0;
-		for (; x < dst_w_aligned; x += 4)
-		{
-			int Y0 = *(src_Y0++);
-			int U0 = *(src_U++);
-			int V0 = *(src_V++);
-			int Y1 = *(src_Y0++);
-			int Y2 = *(src_Y0++);
-			int U2 = *(src_U++);
-			int V2 = *(src_V++);
-			int Y3 = *(src_Y0++);
-			int Y4 = *(src_Y1++);
-			int Y5 = *(src_Y1++);
-			int Y6 = *(src_Y1++);
-			int Y7 = *(src_Y1++);
-
-			U0 -= 128;
-			V0 -= 128;
-			U2 -= 128;
-			V2 -= 128;
-			int U1 = U0;
-			int V1 = V0;
-			int U4 = U0;
-			int V4 = V0;
-			int U5 = U0;
-			int V5 = V0;
-			int U3 = U2;
-			int V3 = V2;
-			int U6 = U2;
-			int V6 = V2;
-			int U7 = U2;
-			int V7 = V2;
-
-			int R0 = Y0 + 1.402 * V0;
-			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
-			int B0 = Y0 + 1.771 * U0;
-			int R1 = Y1 + 1.402 * V1;
-			int G1 = Y1 - 0.345 * U1 - 0.714 * V1;
-			int B1 = Y1 + 1.771 * U1;
-			int R2 = Y2 + 1.402 * V2;
-			int G2 = Y2 - 0.345 * U2 - 0.714 * V2;
-			int B2 = Y2 + 1.771 * U2;
-			int R3 = Y3 + 1.402 * V3;
-			int G3 = Y3 - 0.345 * U3 - 0.714 * V3;
-			int B3 = Y3 + 1.771 * U3;
-			int R4 = Y4 + 1.402 * V4;
-			int G4 = Y4 - 0.345 * U4 - 0.714 * V4;
-			int B4 = Y4 + 1.771 * U4;
-			int R5 = Y5 + 1.402 * V5;
-			int G5 = Y5 - 0.345 * U5 - 0.714 * V5;
-			int B5 = Y5 + 1.771 * U5;
-			int R6 = Y6 + 1.402 * V6;
-			int G6 = Y6 - 0.345 * U6 - 0.714 * V6;
-			int B6 = Y6 + 1.771 * U6;
-			int R7 = Y7 + 1.402 * V7;
-			int G7 = Y7 - 0.345 * U7 - 0.714 * V7;
-			int B7 = Y7 + 1.771 * U7;
-
-			R0 = std::clamp(R0, 0, 255);
-			G0 = std::clamp(G0, 0, 255);
-			B0 = std::clamp(B0, 0, 255);
-			R1 = std::clamp(R1, 0, 255);
-			G1 = std::clamp(G1, 0, 255);
-			B1 = std::clamp(B1, 0, 255);
-			R2 = std::clamp(R2, 0, 255);
-			G2 = std::clamp(G2, 0, 255);
-			B2 = std::clamp(B2, 0, 255);
-			R3 = std::clamp(R3, 0, 255);
-			G3 = std::clamp(G3, 0, 255);
-			B3 = std::clamp(B3, 0, 255);
-			R4 = std::clamp(R4, 0, 255);
-			G4 = std::clamp(G4, 0, 255);
-			B4 = std::clamp(B4, 0, 255);
-			R5 = std::clamp(R5, 0, 255);
-			G5 = std::clamp(G5, 0, 255);
-			B5 = std::clamp(B5, 0, 255);
-			R6 = std::clamp(R6, 0, 255);
-			G6 = std::clamp(G6, 0, 255);
-			B6 = std::clamp(B6, 0, 255);
-			R7 = std::clamp(R7, 0, 255);
-			G7 = std::clamp(G7, 0, 255);
-			B7 = std::clamp(B7, 0, 255);
-
-			*(dst0++) = R0;
-			*(dst0++) = G0;
-			*(dst0++) = B0;
-			*(dst0++) = R1;
-			*(dst0++) = G1;
-			*(dst0++) = B1;
-			*(dst0++) = R2;
-			*(dst0++) = G2;
-			*(dst0++) = B2;
-			*(dst0++) = R3;
-			*(dst0++) = G3;
-			*(dst0++) = B3;
-			*(dst1++) = R4;
-			*(dst1++) = G4;
-			*(dst1++) = B4;
-			*(dst1++) = R5;
-			*(dst1++) = G5;
-			*(dst1++) = B5;
-			*(dst1++) = R6;
-			*(dst1++) = G6;
-			*(dst1++) = B6;
-			*(dst1++) = R7;
-			*(dst1++) = G7;
-			*(dst1++) = B7;
-		}
-		// Straggling pixel columns - we must still do both rows.
-		for (; x < dst_w; x++)
-		{
-			int Y0 = *(src_Y0++);
-			int U0 = *(src_U);
-			int V0 = *(src_V);
-			int Y4 = *(src_Y1++);
-			src_U += (x & 1);
-			src_V += (x & 1);
-
-			U0 -= 128;
-			V0 -= 128;
-			int U4 = U0;
-			int V4 = V0;
-
-			int R0 = Y0 + 1.402 * V0;
-			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
-			int B0 = Y0 + 1.771 * U0;
-			int R4 = Y4 + 1.402 * V4;
-			int G4 = Y4 - 0.345 * U4 - 0.714 * V4;
-			int B4 = Y4 + 1.771 * U4;
-
-			R0 = std::clamp(R0, 0, 255);
-			G0 = std::clamp(G0, 0, 255);
-			B0 = std::clamp(B0, 0, 255);
-			R4 = std::clamp(R4, 0, 255);
-			G4 = std::clamp(G4, 0, 255);
-			B4 = std::clamp(B4, 0, 255);
-
-			*(dst0++) = R0;
-			*(dst0++) = G0;
-			*(dst0++) = B0;
-			*(dst1++) = R4;
-			*(dst1++) = G4;
-			*(dst1++) = B4;
-		}
+		uint8x16_t a = vld1q_u8(row0 + x), b = vld1q_u8(row1 + x);
+		uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(a), w0), vget_low_u8(b), w1);
+		uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(a), w0), vget_high_u8(b), w1);
+		vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(lo, WEIGHT_BITS), vrshrn_n_u16(hi, WEIGHT_BITS)));
+	}
+#elif defined(__SSE2__)
+	const __m128i w0 = _mm_set1_epi16(WEIGHT_ONE - weight), w1 = _mm_set1_epi16(weight);
+	const __m128i round = _mm_set1_epi16(WEIGHT_ONE / 2), zero = _mm_setzero_si128();
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(row0 + x)), b = _mm_loadu_si128((const __m128i *)(row1 + x));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+								   _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+								   _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), WEIGHT_BITS);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), WEIGHT_BITS);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
 	}
-	// Any straggling final row is done with extreme steam power.
-	for (; y < dst_h; y++)
+#endif
+	for (; x < width; x++)
+		dst[x] = (row0[x] * (WEIGHT_ONE - weight) + row1[x] * weight + WEIGHT_ONE / 2) >> WEIGHT_BITS;
+	return dst;
+}
+
+// Resample a row horizontally. This is a gather, so there is nothing to gain from SIMD.
+void resampleRow(uint8_t *dst, const uint8_t *src, const Tap *taps, int width)
+{
+	for (int x = 0; x < width; x++)
 	{
-		const uint8_t *src_Y0 = src + (y + off_y) * src_stride + off_x;
-		const uint8_t *src_U = src + src_Y_size + ((y + off_y) / 2) * (src_stride / 2) + off_x / 2;
-		const uint8_t *src_V = src_U + src_U_size;
-		uint8_t *dst0 = &output[y * dst_stride];
+		const uint8_t *s = src + taps[x].index;
+		dst[x] = (s[0] * (WEIGHT_ONE - taps[x].weight) + s[1] * taps[x].weight + WEIGHT_ONE / 2) >> WEIGHT_BITS;
+	}
+}
 
-		int x = 0;
-		for (; x < dst_w; x++)
+#if defined(__ARM_NEON)
+inline uint8x8x3_t yuvToRgb8(uint8x8_t y, uint8x8_t u, uint8x8_t v)
+{
+	const int16x8_t offset = vdupq_n_s16(128);
+	int16x8_t Y = vreinterpretq_s16_u16(vshll_n_u8(y, COEFF_BITS));
+	int16x8_t U = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u)), offset);
+	int16x8_t V = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v)), offset);
+	uint8x8x3_t rgb;
+	rgb.val[0] = vqrshrun_n_s16(vmlaq_n_s16(Y, V, R_V), COEFF_BITS);
+	rgb.val[1] = vqrshrun_n_s16(vmlsq_n_s16(vmlsq_n_s16(Y, U, G_U), V, G_V), COEFF_BITS);
+	rgb.val[2] = vqrshrun_n_s16(vmlaq_n_s16(Y, U, B_U), COEFF_BITS);
+	return rgb;
+}
+#elif defined(__SSE2__)
+// Converts 8 pixels, held in the low halves of y, u and v, to 16-bit R, G and B.
+inline void yuvToRgb8(__m128i y, __m128i u, __m128i v, __m128i &r, __m128i &g, __m128i &b)
+{
+	const __m128i zero = _mm_setzero_si128(), offset = _mm_set1_epi16(128), round = _mm_set1_epi16(1 << (COEFF_BITS - 1));
+	__m128i Y = _mm_add_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(y, zero), COEFF_BITS), round);
+	__m128i U = _mm_sub_epi16(_mm_unpacklo_epi8(u, zero), offset);
+	__m128i V = _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), offset);
+	r = _mm_srai_epi16(_mm_add_epi16(Y, _mm_mullo_epi16(V, _mm_set1_epi16(R_V))), COEFF_BITS);
+	g = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(Y, _mm_mullo_epi16(U, _mm_set1_epi16(G_U))),
+									 _mm_mullo_epi16(V, _mm_set1_epi16(G_V))),
+					   COEFF_BITS);
+	b = _mm_srai_epi16(_mm_add_epi16(Y, _mm_mullo_epi16(U, _mm_set1_epi16(B_U))), COEFF_BITS);
+}
+#endif
+
+void yuvRowToRgb(uint8_t *dst, const uint8_t *Y, const uint8_t *U, const uint8_t *V, int width)
+{
+	int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16_t y = vld1q_u8(Y + x), u = vld1q_u8(U + x), v = vld1q_u8(V + x);
+		uint8x8x3_t lo = yuvToRgb8(vget_low_u8(y), vget_low_u8(u), vget_low_u8(v));
+		uint8x8x3_t hi = yuvToRgb8(vget_high_u8(y), vget_high_u8(u), vget_high_u8(v));
+		uint8x16x3_t rgb;
+		for (int i = 0; i < 3; i++)
+			rgb.val[i] = vcombine_u8(lo.val[i], hi.val[i]);
+		vst3q_u8(dst + 3 * x, rgb);
+	}
+#elif defined(__SSE2__)
+	// SSE2 has no byte shuffle to interleave with, so that part is left to the compiler.
+	alignas(16) uint8_t rgb[3][16];
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i y = _mm_loadu_si128((const __m128i *)(Y + x)), u = _mm_loadu_si128((const __m128i *)(U + x)),
+				v = _mm_loadu_si128((const __m128i *)(V + x));
+		__m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+		yuvToRgb8(y, u, v, r_lo, g_lo, b_lo);
+		yuvToRgb8(_mm_srli_si128(y, 8), _mm_srli_si128(u, 8), _mm_srli_si128(v, 8), r_hi, g_hi, b_hi);
+		_mm_store_si128((__m128i *)rgb[0], _mm_packus_epi16(r_lo, r_hi));
+		_mm_store_si128((__m128i *)rgb[1], _mm_packus_epi16(g_lo, g_hi));
+		_mm_store_si128((__m128i *)rgb[2], _mm_packus_epi16(b_lo, b_hi));
+		uint8_t *d = dst + 3 * x;
+		for (int i = 0; i < 16; i++, d += 3)
+			d[0] = rgb[0][i], d[1] = rgb[1][i], d[2] = rgb[2][i];
+	}
+#endif
+	constexpr int round = 1 << (COEFF_BITS - 1);
+	for (uint8_t *d = dst + 3 * x; x < width; x++, d += 3)
+	{
+		int y = (Y[x] << COEFF_BITS) + round, u = U[x] - 128, v = V[x] - 128;
+		d[0] = std::clamp((y + R_V * v) >> COEFF_BITS, 0, 255);
+		d[1] = std::clamp((y - G_U * u - G_V * v) >> COEFF_BITS, 0, 255);
+		d[2] = std::clamp((y + B_U * u) >> COEFF_BITS, 0, 255);
+	}
+}
+
+} // namespace
+
+void PostProcessingStage::Yuv420ToRgb(uint8_t *dst, const uint8_t *src, int src_w, int src_h, int src_stride,
+									  int dst_w, int dst_h, int dst_stride)
+{
+	// Scratch space is kept per thread, so nothing is allocated once it has grown.
+	thread_local std::vector<Tap> x_taps, uv_x_taps;
+	thread_local std::vector<uint8_t> scratch;
+
+	int uv_w = src_w / 2, uv_h = src_h / 2, uv_stride = src_stride / 2;
+	const uint8_t *src_U = src + src_h * src_stride;
+	const uint8_t *src_V = src_U + uv_h * uv_stride;
+
+	makeTaps(x_taps, src_w, dst_w);
+	makeTaps(uv_x_taps, uv_w, dst_w);
+	scratch.resize(src_w + 2 * uv_w + 3 * dst_w);
+	uint8_t *blend_Y = scratch.data(), *blend_U = blend_Y + src_w, *blend_V = blend_U + uv_w;
+	uint8_t *row_Y = blend_V + uv_w, *row_U = row_Y + dst_w, *row_V = row_U + dst_w;
+
+	for (int y = 0; y < dst_h; y++)
+	{
+		// Scale vertically first, then horizontally, then convert the row to RGB.
+		Tap tap = makeTap(y, src_h, dst_h), uv_tap = makeTap(y, uv_h, dst_h);
+		const uint8_t *Y_row0 = src + tap.index * src_stride;
+		const uint8_t *U_row0 = src_U + uv_tap.index * uv_stride;
+		const uint8_t *V_row0 = src_V + uv_tap.index * uv_stride;
+		const uint8_t *Y = blendRows(blend_Y, Y_row0, Y_row0 + src_stride, tap.weight, src_w);
+		const uint8_t *U = blendRows(blend_U, U_row0, U_row0 + uv_stride, uv_tap.weight, uv_w);
+		const uint8_t *V = blendRows(blend_V, V_row0, V_row0 + uv_stride, uv_tap.weight, uv_w);
+
+		if (dst_w != src_w)
+		{
+			resampleRow(row_Y, Y, x_taps.data(), dst_w);
+			Y = row_Y;
+		}
+		if (dst_w != uv_w)
 		{
-			int Y0 = *(src_Y0++);
-			int U0 = *(src_U);
-			int V0 = *(src_V);
-			src_U += (x & 1);
-			src_V += (x & 1);
-
-			U0 -= 128;
-			V0 -= 128;
-
-			int R0 = Y0 + 1.402 * V0;
-			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
-			int B0 = Y0 + 1.771 * U0;
-
-			R0 = std::clamp(R0, 0, 255);
-			G0 = std::clamp(G0, 0, 255);
-			B0 = std::clamp(B0, 0, 255);
-
-			*(dst0++) = R0;
-			*(dst0++) = G0;
-			*(dst0++) = B0;
+			resampleRow(row_U, U, uv_x_taps.data(), dst_w);
+			resampleRow(row_V, V, uv_x_taps.data(), dst_w);
+			U = row_U;
+			V = row_V;
 		}
+
+		yuvRowToRgb(dst + y * dst_stride, Y, U, V, dst_w);
 	}
+}
 
+std::vector<uint8_t> PostProcessingStage::Yuv420ToRgb(const uint8_t *src, int src_w, int src_h, int src_stride,
+													  int dst_w, int dst_h, int dst_stride)
+{
+	std::vector<uint8_t> output(dst_h * dst_stride);
+	Yuv420ToRgb(output.data(), src, src_w, src_h, src_stride, dst_w, dst_h, dst_stride);
 	return output;
 }
 
@@ -52,8 +52,11 @@ public:
 
 	// Below here are some helpers provided for the convenience of derived classes.
 
-	// Convert YUV420 image to RGB. We crop from the centre of the image if the src
-	// image is larger than the destination.
+	// Convert YUV420 image to packed RGB in the caller's buffer, which must hold dst_h * dst_stride
+	// bytes. The whole of the src image is scaled (bilinearly) to the destination size.
+	static void Yuv420ToRgb(uint8_t *dst, const uint8_t *src, int src_w, int src_h, int src_stride, int dst_w,
+							int dst_h, int dst_stride);
+	// As above, but returning a new buffer.
 	static std::vector<uint8_t> Yuv420ToRgb(const uint8_t *src, int src_w, int src_h, int src_stride, int dst_w,
 											int dst_h, int dst_stride);
 
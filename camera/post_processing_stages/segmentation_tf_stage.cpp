@@ -91,7 +91,7 @@ void SegmentationTfStage::applyResults(CompletedRequestPtr &completed_request)
 	if (!config()->draw)
 		return;
 
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[main_stream_])[0];
+	libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[main_stream_])[0];
 	int y_offset = main_h_ - HEIGHT;
 	int x_offset = main_w_ - WIDTH;
 	int scale = 255 / labels_.size();
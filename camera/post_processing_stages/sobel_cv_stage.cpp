@@ -59,7 +59,7 @@ bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
 {
 	unsigned int w, h, stride;
 	app_->StreamDimensions(stream_, &w, &h, &stride);
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[stream_])[0];
 	uint8_t *ptr = (uint8_t *)buffer.data();
 
 	//Everything beyond this point is image processing...
@@ -103,7 +103,7 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
 			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[lores_stream_])[0];
+			libcamera::Span<uint8_t> buffer = app_->MappedPlanes(completed_request->buffers[lores_stream_])[0];
 
 			// Copy the lores image here and let the asynchronous thread convert it to RGB.
 			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
@@ -129,20 +129,18 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 void TfStage::runInference()
 {
 	int input = interpreter_->inputs()[0];
-	std::vector<uint8_t> rgb_image =
-		Yuv420ToRgb(lores_copy_.data(), lores_w_, lores_h_, lores_stride_, tf_w_, tf_h_, tf_w_ * 3);
 
+	// 8-bit models take the RGB image directly in their input tensor.
 	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
-	{
-		uint8_t *tensor = interpreter_->typed_tensor<uint8_t>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = rgb_image[i];
-	}
+		Yuv420ToRgb(interpreter_->typed_tensor<uint8_t>(input), lores_copy_.data(), lores_w_, lores_h_, lores_stride_,
+					tf_w_, tf_h_, tf_w_ * 3);
 	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
 	{
+		rgb_image_.resize(tf_w_ * tf_h_ * 3);
+		Yuv420ToRgb(rgb_image_.data(), lores_copy_.data(), lores_w_, lores_h_, lores_stride_, tf_w_, tf_h_, tf_w_ * 3);
 		float *tensor = interpreter_->typed_tensor<float>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = (rgb_image[i] - config_->normalisation_offset) / config_->normalisation_scale;
+		for (unsigned int i = 0; i < rgb_image_.size(); i++)
+			tensor[i] = (rgb_image_[i] - config_->normalisation_offset) / config_->normalisation_scale;
 	}
 
 	if (interpreter_->Invoke() != kTfLiteOk)